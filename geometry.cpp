@@ -277,3 +277,50 @@ void buildMesh() {
     quads[i] = makeQuad(rects[i]);
   }
 }
+
+// The same rects cut into cells no bigger than cellSize, for projections
+// that don't keep straight edges straight. Rect i's triangles are
+// tessellatedCount[i] vertices from tessellatedFirst[i].
+Vertex* tessellatedVertices;
+int tessellatedVertexCount;
+int tessellatedFirst[ARRAY_LENGTH(rects)];
+int tessellatedCount[ARRAY_LENGTH(rects)];
+
+void buildTessellatedMesh(float cellSize) {
+  int columns[ARRAY_LENGTH(rects)];
+  int rows[ARRAY_LENGTH(rects)];
+
+  tessellatedVertexCount = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    columns[i] = glm::max(1, (int) ceilf(glm::length(rects[i].da) / cellSize));
+    rows[i] = glm::max(1, (int) ceilf(glm::length(rects[i].db) / cellSize));
+    tessellatedFirst[i] = tessellatedVertexCount;
+    tessellatedCount[i] = 6 * columns[i] * rows[i];
+    tessellatedVertexCount += tessellatedCount[i];
+  }
+
+  tessellatedVertices = (Vertex*) malloc(sizeof(Vertex) * tessellatedVertexCount);
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    Rect rect = rects[i];
+    vec3 da = rect.da / (float) columns[i];
+    vec3 db = rect.db / (float) rows[i];
+
+    Vertex* vertex = tessellatedVertices + tessellatedFirst[i];
+    for (int y = 0; y < rows[i]; y++) {
+      for (int x = 0; x < columns[i]; x++) {
+        vec3 corner = rect.origin + da * (float) x + db * (float) y;
+        Quad quad = makeQuad(corner, corner + da, corner + da + db, corner + db, normal(rect), rect.color);
+
+        // makeQuad maps the cell to the whole texture; scale that down to
+        // the cell's part of it.
+        for (int v = 0; v < 6; v++) {
+          Vertex cell = quad.vertices[v];
+          cell.uv[0] = (x + cell.uv[0]) / columns[i];
+          cell.uv[1] = (y + cell.uv[1]) / rows[i];
+          *vertex++ = cell;
+        }
+      }
+    }
+  }
+}
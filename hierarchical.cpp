@@ -0,0 +1,298 @@
+// Hierarchical radiosity (Hanrahan, Salzman and Aupperle): every rect is a
+// quadtree of patches down to single texels, and patches gather from each
+// other over links made as high up the trees as the light carried allows.
+// Each pass starts over from one link per pair of rects and splits the
+// larger patch of a pair while its share of the source's light, radiosity
+// times form factor times receiving area, is above HIERARCHY_EPSILON. Light
+// gathered at a patch is pushed down to the texels under it, and texels'
+// radiosity pulled back up as area weighted averages, so far apart or dim
+// pairs cost one link however many texels they cover.
+#define HIERARCHY_EPSILON 5e-6f
+
+// Visibility is the fraction of rays between a grid of this many points a
+// side on each patch that no rect's front face blocks.
+#define VISIBILITY_SAMPLES 4
+
+struct Patch {
+  int rect;
+  // The texels covered, [x0, x1) by [y0, y1).
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+  vec3 center;
+  float area;
+  Color irradiance;
+  Color radiosity;
+  int children[4];
+  int childCount;
+};
+
+// The receiver gathers formFactor times the source's radiosity.
+struct Link {
+  int receiver;
+  int source;
+  float formFactor;
+};
+
+Patch* patches;
+int patchCount;
+int rootPatches[ARRAY_LENGTH(rects)];
+
+Link* links;
+int linkCount;
+int linkCapacity;
+
+long rayCount;
+
+vec3 patchPoint(const Patch& patch, float s, float t) {
+  Rect rect = rects[patch.rect];
+  int width = glm::length(rect.da) * texelDensity;
+  int height = glm::length(rect.db) * texelDensity;
+
+  return rect.origin
+    + rect.da * ((patch.x0 + s * (patch.x1 - patch.x0)) / width)
+    + rect.db * ((patch.y0 + t * (patch.y1 - patch.y0)) / height);
+}
+
+int buildPatch(int rect, int x0, int y0, int x1, int y1) {
+  int index = patchCount++;
+  Patch& patch = patches[index];
+
+  patch.rect = rect;
+  patch.x0 = x0;
+  patch.y0 = y0;
+  patch.x1 = x1;
+  patch.y1 = y1;
+  patch.center = patchPoint(patch, 0.5f, 0.5f);
+  int width = glm::length(rects[rect].da) * texelDensity;
+  int height = glm::length(rects[rect].db) * texelDensity;
+  patch.area = glm::length(rects[rect].da) * glm::length(rects[rect].db)
+    * (x1 - x0) * (y1 - y0) / (width * height);
+  patch.childCount = 0;
+
+  // Halve each side longer than a texel.
+  int xs[3] = {x0, x1 - x0 > 1 ? (x0 + x1) / 2 : x1, x1};
+  int ys[3] = {y0, y1 - y0 > 1 ? (y0 + y1) / 2 : y1, y1};
+  int columns = xs[1] == x1 ? 1 : 2;
+  int rows = ys[1] == y1 ? 1 : 2;
+  if (columns * rows == 1) {
+    return index;
+  }
+
+  for (int j = 0; j < rows; j++) {
+    for (int i = 0; i < columns; i++) {
+      int child = buildPatch(rect, xs[i], ys[j], xs[i + 1], ys[j + 1]);
+      patches[index].children[patches[index].childCount++] = child;
+    }
+  }
+  return index;
+}
+
+void hierarchySetup() {
+  int texels = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+    texels += width * height;
+  }
+
+  // A tree with a leaf per texel has fewer nodes than twice its leaves.
+  patches = (Patch*) malloc(sizeof(Patch) * 2 * texels);
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+    rootPatches[i] = buildPatch(i, 0, 0, width, height);
+  }
+
+  linkCapacity = 1 << 16;
+  links = (Link*) malloc(sizeof(Link) * linkCapacity);
+
+  printf("Hierarchy: %d patches over %d texels\n", patchCount, texels);
+}
+
+// The fraction of rays between the patches that no front face other than
+// theirs blocks, cast a packet at a time (see intersect.cpp).
+float visibility(const Patch& receiver, const Patch& source) {
+  const int n = VISIBILITY_SAMPLES;
+  int visible = 0;
+
+  RayPacket packet;
+  int count = 0;
+
+  // The source's grid is transposed so rays don't all run parallel.
+  for (int j = 0; j < n; j++) {
+    for (int i = 0; i < n; i++) {
+      vec3 a = patchPoint(receiver, (i + 0.5f) / n, (j + 0.5f) / n);
+      vec3 b = patchPoint(source, (j + 0.5f) / n, (i + 0.5f) / n);
+      packet.ox[count] = a.x;
+      packet.oy[count] = a.y;
+      packet.oz[count] = a.z;
+      packet.dx[count] = b.x - a.x;
+      packet.dy[count] = b.y - a.y;
+      packet.dz[count] = b.z - a.z;
+      packet.maxT[count] = 1.0f - RAY_EPSILON;
+      count++;
+
+      if (count == RAY_LANES || (i == n - 1 && j == n - 1)) {
+        castPacket(&packet, count, receiver.rect, source.rect);
+        for (int lane = 0; lane < count; lane++) {
+          if (packet.hit[lane] < 0) {
+            visible++;
+          }
+        }
+        rayCount += count;
+        count = 0;
+      }
+    }
+  }
+
+  return (float) visible / (n * n);
+}
+
+// Whether all of a patch is behind the plane another faces out of.
+bool behind(const Patch& patch, const Patch& plane) {
+  vec3 n = normal(rects[plane.rect]);
+  for (int i = 0; i < 4; i++) {
+    vec3 corner = patchPoint(patch, (float) (i & 1), (float) (i >> 1));
+    if (glm::dot(n, corner - plane.center) > 1e-5f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void addLink(int receiver, int source, float formFactor) {
+  if (linkCount == linkCapacity) {
+    linkCapacity *= 2;
+    links = (Link*) realloc(links, sizeof(Link) * linkCapacity);
+  }
+
+  Link link = {receiver, source, formFactor};
+  links[linkCount++] = link;
+}
+
+float luminance(Color c) {
+  return (c.r + c.g + c.b) / 3.0f;
+}
+
+// Links receiver to source, or their children if the link would carry too
+// much light to treat as one. The form factor is a point to disk estimate
+// from the receiver's center; pairs whose centers can't see each other
+// although parts of them can are split regardless.
+void refineLink(int receiver, int source) {
+  const Patch& p = patches[receiver];
+  const Patch& q = patches[source];
+
+  if (behind(q, p) || behind(p, q)) {
+    return;
+  }
+
+  vec3 d = q.center - p.center;
+  float r2 = glm::dot(d, d);
+  float cosP = glm::dot(normal(rects[p.rect]), d) / sqrtf(r2);
+  float cosQ = -glm::dot(normal(rects[q.rect]), d) / sqrtf(r2);
+  bool straddling = cosP <= 0.0f || cosQ <= 0.0f;
+
+  float formFactor = 0.0f;
+  if (!straddling) {
+    formFactor = cosP * cosQ * q.area / (glm::pi<float>() * r2 + q.area) * visibility(p, q);
+  }
+
+  bool split = straddling
+    ? luminance(q.radiosity) > 0.0f
+    : luminance(q.radiosity) * formFactor * p.area > HIERARCHY_EPSILON;
+
+  if (split && (p.childCount || q.childCount)) {
+    if (p.childCount && (p.area >= q.area || !q.childCount)) {
+      for (int i = 0; i < p.childCount; i++) {
+        refineLink(p.children[i], source);
+      }
+    } else {
+      for (int i = 0; i < q.childCount; i++) {
+        refineLink(receiver, q.children[i]);
+      }
+    }
+    return;
+  }
+
+  if (formFactor > 0.0f) {
+    addLink(receiver, source, formFactor);
+  }
+}
+
+// Leaves take their radiosity from the lightmaps, the sun as the 8-bit
+// textures show it, and parents the average of their children.
+Color pullRadiosity(int index) {
+  Patch& patch = patches[index];
+  patch.irradiance = BLACK;
+
+  if (!patch.childCount) {
+    Rect rect = rects[patch.rect];
+    int width = glm::length(rect.da) * texelDensity;
+    Color texel = textureData[patch.rect][patch.y0 * width + patch.x0];
+    patch.radiosity = patch.rect == 0 ? sampledColor(texel) : texel;
+    return patch.radiosity;
+  }
+
+  Color sum = BLACK;
+  for (int i = 0; i < patch.childCount; i++) {
+    Patch& child = patches[patch.children[i]];
+    sum += pullRadiosity(patch.children[i]) * (child.area / patch.area);
+  }
+  patch.radiosity = sum;
+  return sum;
+}
+
+// Hands what each patch gathered down to the texels under it.
+void pushIrradiance(int index, Color above) {
+  Patch& patch = patches[index];
+  Color irradiance = above + patch.irradiance;
+
+  if (!patch.childCount) {
+    HemicubeSample sample = {patch.rect, patch.x0, patch.y0, 0};
+    storeSample(sample, irradiance);
+    return;
+  }
+
+  for (int i = 0; i < patch.childCount; i++) {
+    pushIrradiance(patch.children[i], irradiance);
+  }
+}
+
+void hierarchicalPass() {
+  passError = 0.0f;
+
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    pullRadiosity(rootPatches[i]);
+  }
+
+  linkCount = 0;
+  rayCount = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    for (int j = 0; j < ARRAY_LENGTH(rects); j++) {
+      if (i != j) {
+        refineLink(rootPatches[i], rootPatches[j]);
+      }
+    }
+  }
+  Uint64 refined = SDL_GetPerformanceCounter();
+
+  for (int i = 0; i < linkCount; i++) {
+    Link link = links[i];
+    patches[link.receiver].irradiance += patches[link.source].radiosity * link.formFactor;
+  }
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    pushIrradiance(rootPatches[i], BLACK);
+  }
+
+  Uint64 end = SDL_GetPerformanceCounter();
+  float frequency = SDL_GetPerformanceFrequency();
+
+  printf("Error: %f\n", passError);
+  printf("%d links, %ld rays: refined in %.2fs, gathered in %.3fs\n",
+         linkCount, rayCount, (refined - start) / frequency, (end - refined) / frequency);
+}
@@ -0,0 +1,779 @@
+// Rays against rects, for visibility on the CPU. Every rect is a
+// parallelogram, so a hit is a plane intersection and two dot products
+// giving where along each edge it lands, with no triangles. rectTable keeps
+// just that in a structure of arrays, padded with rects that face nowhere
+// to a whole number of RAY_LANES, so the SIMD kernels can test one ray
+// against RAY_LANES rects at once (intersectRectsWide) or RAY_LANES rays,
+// say from one texel, against one rect at once (intersectPacket). Every
+// lane runs the scalar loop's arithmetic in the same order and ties go to
+// the lower rect, so all three find the same hits.
+#if defined(__AVX__)
+#define RAY_LANES 8
+#elif defined(__SSE__)
+#define RAY_LANES 4
+#else
+#define RAY_LANES 1
+#endif
+
+// Hits nearer than this are the ray leaving its own surface.
+#define RAY_EPSILON 1e-4f
+
+#define RECT_TABLE_SIZE ((ARRAY_LENGTH(rects) + 7) / 8 * 8)
+
+struct RectTable {
+  // Planes n . p = d, n out of the front face.
+  float nx[RECT_TABLE_SIZE];
+  float ny[RECT_TABLE_SIZE];
+  float nz[RECT_TABLE_SIZE];
+  float d[RECT_TABLE_SIZE];
+  // u = p . (ux, uy, uz) - uw goes from 0 to 1 along da, and v likewise
+  // along db.
+  float ux[RECT_TABLE_SIZE];
+  float uy[RECT_TABLE_SIZE];
+  float uz[RECT_TABLE_SIZE];
+  float uw[RECT_TABLE_SIZE];
+  float vx[RECT_TABLE_SIZE];
+  float vy[RECT_TABLE_SIZE];
+  float vz[RECT_TABLE_SIZE];
+  float vw[RECT_TABLE_SIZE];
+};
+
+RectTable rectTable;
+
+// Rays cast together, a lane each, from RAY_LANES origins. Lanes past the
+// count cast by castPacket() are left alone.
+struct RayPacket {
+  float ox[RAY_LANES];
+  float oy[RAY_LANES];
+  float oz[RAY_LANES];
+  float dx[RAY_LANES];
+  float dy[RAY_LANES];
+  float dz[RAY_LANES];
+  float maxT[RAY_LANES];
+  // The rect each ray hit, or -1, and where on it.
+  int hit[RAY_LANES];
+  float u[RAY_LANES];
+  float v[RAY_LANES];
+};
+
+void buildRectTable() {
+  RectTable& r = rectTable;
+  memset(&r, 0, sizeof(r));
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    Rect rect = rects[i];
+    vec3 n = normal(rect);
+    vec3 u = rect.da / glm::dot(rect.da, rect.da);
+    vec3 v = rect.db / glm::dot(rect.db, rect.db);
+
+    r.nx[i] = n.x;
+    r.ny[i] = n.y;
+    r.nz[i] = n.z;
+    r.d[i] = glm::dot(n, rect.origin);
+    r.ux[i] = u.x;
+    r.uy[i] = u.y;
+    r.uz[i] = u.z;
+    r.uw[i] = glm::dot(u, rect.origin);
+    r.vx[i] = v.x;
+    r.vy[i] = v.y;
+    r.vz[i] = v.z;
+    r.vw[i] = glm::dot(v, rect.origin);
+  }
+}
+
+// The nearest front face hit along origin + direction * t for t in
+// (RAY_EPSILON, maxT), other than skipA's and skipB's, or -1. Back faces
+// are culled when rendering hemicubes, so rays pass through them here too.
+int intersectRects(vec3 origin, vec3 direction, int skipA, int skipB, float maxT,
+                   float* hitU, float* hitV) {
+  const RectTable& r = rectTable;
+  int nearest = -1;
+  float nearestT = maxT;
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    float facing = r.nx[i] * direction.x + r.ny[i] * direction.y + r.nz[i] * direction.z;
+    if (!(facing < 0.0f) || i == skipA || i == skipB) {
+      continue;
+    }
+
+    float t = (r.d[i] - (r.nx[i] * origin.x + r.ny[i] * origin.y + r.nz[i] * origin.z)) / facing;
+    if (!(RAY_EPSILON < t && t < nearestT)) {
+      continue;
+    }
+
+    float x = origin.x + direction.x * t;
+    float y = origin.y + direction.y * t;
+    float z = origin.z + direction.z * t;
+    float u = r.ux[i] * x + r.uy[i] * y + r.uz[i] * z - r.uw[i];
+    float v = r.vx[i] * x + r.vy[i] * y + r.vz[i] * z - r.vw[i];
+    if (0.0f <= u && u <= 1.0f && 0.0f <= v && v <= 1.0f) {
+      nearest = i;
+      nearestT = t;
+      *hitU = u;
+      *hitV = v;
+    }
+  }
+
+  return nearest;
+}
+
+// Macros rather than functions, so the intrinsics are inlined in builds
+// without optimization too.
+#if RAY_LANES == 8
+typedef __m256 Lanes;
+
+#define lanesLoad _mm256_loadu_ps
+#define lanesSet _mm256_set1_ps
+#define lanesStore _mm256_storeu_ps
+#define lanesAdd _mm256_add_ps
+#define lanesSub _mm256_sub_ps
+#define lanesMul _mm256_mul_ps
+#define lanesDiv _mm256_div_ps
+#define lanesLess(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define lanesLessEqual(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define lanesNotEqual(a, b) _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+#define lanesAnd _mm256_and_ps
+// mask ? a : b, lane by lane.
+#define lanesSelect(mask, a, b) _mm256_blendv_ps(b, a, mask)
+#define lanesAny _mm256_movemask_ps
+#define lanesIndex() _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)
+#elif RAY_LANES == 4
+typedef __m128 Lanes;
+
+#define lanesLoad _mm_loadu_ps
+#define lanesSet _mm_set1_ps
+#define lanesStore _mm_storeu_ps
+#define lanesAdd _mm_add_ps
+#define lanesSub _mm_sub_ps
+#define lanesMul _mm_mul_ps
+#define lanesDiv _mm_div_ps
+#define lanesLess _mm_cmplt_ps
+#define lanesLessEqual _mm_cmple_ps
+#define lanesNotEqual _mm_cmpneq_ps
+#define lanesAnd _mm_and_ps
+#define lanesSelect(mask, a, b) _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
+#define lanesAny _mm_movemask_ps
+#define lanesIndex() _mm_setr_ps(0, 1, 2, 3)
+#endif
+
+// intersectRects() over RAY_LANES rects at a time. Each lane keeps the
+// nearest hit among its own rects, and the nearest of those wins.
+int intersectRectsWide(vec3 origin, vec3 direction, int skipA, int skipB, float maxT,
+                       float* hitU, float* hitV) {
+#if RAY_LANES > 1
+  const RectTable& r = rectTable;
+  const Lanes zero = lanesSet(0.0f);
+  const Lanes one = lanesSet(1.0f);
+  const Lanes epsilon = lanesSet(RAY_EPSILON);
+  const Lanes skippedA = lanesSet((float) skipA);
+  const Lanes skippedB = lanesSet((float) skipB);
+
+  Lanes ox = lanesSet(origin.x);
+  Lanes oy = lanesSet(origin.y);
+  Lanes oz = lanesSet(origin.z);
+  Lanes dx = lanesSet(direction.x);
+  Lanes dy = lanesSet(direction.y);
+  Lanes dz = lanesSet(direction.z);
+
+  Lanes nearestT = lanesSet(maxT);
+  Lanes nearestRect = lanesSet(-1.0f);
+  Lanes nearestU = zero;
+  Lanes nearestV = zero;
+  Lanes index = lanesIndex();
+
+  for (int i = 0; i < RECT_TABLE_SIZE; i += RAY_LANES) {
+    Lanes rect = index;
+    index = lanesAdd(index, lanesSet((float) RAY_LANES));
+
+    Lanes nx = lanesLoad(r.nx + i);
+    Lanes ny = lanesLoad(r.ny + i);
+    Lanes nz = lanesLoad(r.nz + i);
+    Lanes facing = lanesAdd(lanesAdd(lanesMul(nx, dx), lanesMul(ny, dy)), lanesMul(nz, dz));
+    Lanes hit = lanesLess(facing, zero);
+    if (!lanesAny(hit)) {
+      continue;
+    }
+
+    Lanes distance = lanesAdd(lanesAdd(lanesMul(nx, ox), lanesMul(ny, oy)), lanesMul(nz, oz));
+    Lanes t = lanesDiv(lanesSub(lanesLoad(r.d + i), distance), facing);
+    hit = lanesAnd(hit, lanesAnd(lanesLess(epsilon, t), lanesLess(t, nearestT)));
+    if (!lanesAny(hit)) {
+      continue;
+    }
+
+    Lanes x = lanesAdd(ox, lanesMul(dx, t));
+    Lanes y = lanesAdd(oy, lanesMul(dy, t));
+    Lanes z = lanesAdd(oz, lanesMul(dz, t));
+    Lanes u = lanesSub(lanesAdd(lanesAdd(lanesMul(lanesLoad(r.ux + i), x), lanesMul(lanesLoad(r.uy + i), y)),
+                                lanesMul(lanesLoad(r.uz + i), z)),
+                       lanesLoad(r.uw + i));
+    Lanes v = lanesSub(lanesAdd(lanesAdd(lanesMul(lanesLoad(r.vx + i), x), lanesMul(lanesLoad(r.vy + i), y)),
+                                lanesMul(lanesLoad(r.vz + i), z)),
+                       lanesLoad(r.vw + i));
+    hit = lanesAnd(hit, lanesAnd(lanesAnd(lanesLessEqual(zero, u), lanesLessEqual(u, one)),
+                                 lanesAnd(lanesLessEqual(zero, v), lanesLessEqual(v, one))));
+    hit = lanesAnd(hit, lanesAnd(lanesNotEqual(rect, skippedA), lanesNotEqual(rect, skippedB)));
+    if (!lanesAny(hit)) {
+      continue;
+    }
+
+    nearestT = lanesSelect(hit, t, nearestT);
+    nearestRect = lanesSelect(hit, rect, nearestRect);
+    nearestU = lanesSelect(hit, u, nearestU);
+    nearestV = lanesSelect(hit, v, nearestV);
+  }
+
+  float ts[RAY_LANES];
+  float hits[RAY_LANES];
+  float us[RAY_LANES];
+  float vs[RAY_LANES];
+  lanesStore(ts, nearestT);
+  lanesStore(hits, nearestRect);
+  lanesStore(us, nearestU);
+  lanesStore(vs, nearestV);
+
+  int nearest = -1;
+  float nearestDistance = maxT;
+  for (int lane = 0; lane < RAY_LANES; lane++) {
+    int hit = (int) hits[lane];
+    if (hit >= 0 && (nearest < 0 || ts[lane] < nearestDistance
+                     || (ts[lane] == nearestDistance && hit < nearest))) {
+      nearest = hit;
+      nearestDistance = ts[lane];
+      *hitU = us[lane];
+      *hitV = vs[lane];
+    }
+  }
+
+  return nearest;
+#else
+  return intersectRects(origin, direction, skipA, skipB, maxT, hitU, hitV);
+#endif
+}
+
+// intersectRects() for every ray of a packet at once, a rect at a time, so
+// each rect's table entry is read once for all of them. Rays that start
+// close together and point roughly the same way tend to skip the same
+// rects, which is where this beats casting them one by one.
+void intersectPacket(RayPacket* packet, int skipA, int skipB) {
+#if RAY_LANES > 1
+  const RectTable& r = rectTable;
+  const Lanes zero = lanesSet(0.0f);
+  const Lanes one = lanesSet(1.0f);
+  const Lanes epsilon = lanesSet(RAY_EPSILON);
+
+  Lanes ox = lanesLoad(packet->ox);
+  Lanes oy = lanesLoad(packet->oy);
+  Lanes oz = lanesLoad(packet->oz);
+  Lanes dx = lanesLoad(packet->dx);
+  Lanes dy = lanesLoad(packet->dy);
+  Lanes dz = lanesLoad(packet->dz);
+
+  Lanes nearestT = lanesLoad(packet->maxT);
+  Lanes nearestRect = lanesSet(-1.0f);
+  Lanes nearestU = zero;
+  Lanes nearestV = zero;
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    if (i == skipA || i == skipB) {
+      continue;
+    }
+
+    Lanes nx = lanesSet(r.nx[i]);
+    Lanes ny = lanesSet(r.ny[i]);
+    Lanes nz = lanesSet(r.nz[i]);
+    Lanes facing = lanesAdd(lanesAdd(lanesMul(nx, dx), lanesMul(ny, dy)), lanesMul(nz, dz));
+    Lanes hit = lanesLess(facing, zero);
+    if (!lanesAny(hit)) {
+      continue;
+    }
+
+    Lanes distance = lanesAdd(lanesAdd(lanesMul(nx, ox), lanesMul(ny, oy)), lanesMul(nz, oz));
+    Lanes t = lanesDiv(lanesSub(lanesSet(r.d[i]), distance), facing);
+    hit = lanesAnd(hit, lanesAnd(lanesLess(epsilon, t), lanesLess(t, nearestT)));
+    if (!lanesAny(hit)) {
+      continue;
+    }
+
+    Lanes x = lanesAdd(ox, lanesMul(dx, t));
+    Lanes y = lanesAdd(oy, lanesMul(dy, t));
+    Lanes z = lanesAdd(oz, lanesMul(dz, t));
+    Lanes u = lanesSub(lanesAdd(lanesAdd(lanesMul(lanesSet(r.ux[i]), x), lanesMul(lanesSet(r.uy[i]), y)),
+                                lanesMul(lanesSet(r.uz[i]), z)),
+                       lanesSet(r.uw[i]));
+    Lanes v = lanesSub(lanesAdd(lanesAdd(lanesMul(lanesSet(r.vx[i]), x), lanesMul(lanesSet(r.vy[i]), y)),
+                                lanesMul(lanesSet(r.vz[i]), z)),
+                       lanesSet(r.vw[i]));
+    hit = lanesAnd(hit, lanesAnd(lanesAnd(lanesLessEqual(zero, u), lanesLessEqual(u, one)),
+                                 lanesAnd(lanesLessEqual(zero, v), lanesLessEqual(v, one))));
+    if (!lanesAny(hit)) {
+      continue;
+    }
+
+    nearestT = lanesSelect(hit, t, nearestT);
+    nearestRect = lanesSelect(hit, lanesSet((float) i), nearestRect);
+    nearestU = lanesSelect(hit, u, nearestU);
+    nearestV = lanesSelect(hit, v, nearestV);
+  }
+
+  float hits[RAY_LANES];
+  lanesStore(hits, nearestRect);
+  lanesStore(packet->u, nearestU);
+  lanesStore(packet->v, nearestV);
+  for (int lane = 0; lane < RAY_LANES; lane++) {
+    packet->hit[lane] = (int) hits[lane];
+  }
+#else
+  vec3 origin(packet->ox[0], packet->oy[0], packet->oz[0]);
+  vec3 direction(packet->dx[0], packet->dy[0], packet->dz[0]);
+  packet->hit[0] = intersectRects(origin, direction, skipA, skipB, packet->maxT[0],
+                                  &packet->u[0], &packet->v[0]);
+#endif
+}
+
+// With --accel=grid, queries walk a uniform grid over the scene instead of
+// testing every rect. Each cell lists the rects whose bounds, padded by
+// GRID_EPSILON, touch it, in a bucket per way an axis-aligned rect can
+// face and one for any other rect. Rays go from cell to cell with a 3D-DDA
+// (Amanatides and Woo), testing only the buckets of rects facing against
+// them, and stop at the first cell that ends past the nearest hit so far.
+// Rays along an axis, where every rect they can hit faces back along it,
+// walk a single column of cells and test one bucket of axis-aligned rects.
+// An axis-aligned rect's test is the table's with the zero terms dropped,
+// which leaves the result unchanged, so the grid finds exactly the hits
+// intersectRects() does.
+#define GRID_CELLS_PER_RECT 8
+#define GRID_EPSILON 1e-3f
+
+// Buckets 2 * axis + 0 and 2 * axis + 1 hold rects facing up and down that
+// axis, and the last one everything else.
+#define GRID_BUCKETS 7
+
+struct AxisRect {
+  // The axis it faces along, or -1 if it isn't axis-aligned, and those
+  // along which u and v run.
+  int axis;
+  int uAxis;
+  int vAxis;
+  // rectTable's only nonzero n, u and v components.
+  float n;
+  float u;
+  float v;
+};
+
+AxisRect axisRects[ARRAY_LENGTH(rects)];
+
+int gridCells[3];
+vec3 gridOrigin;
+vec3 gridCellSize;
+vec3 gridCellInverse;
+
+// Bucket b of cell c is gridRects[gridStart[c * GRID_BUCKETS + b]] up to
+// the start of the next.
+int* gridStart;
+int* gridRects;
+
+// The only axis a vector has a component along, or -1.
+int onlyAxis(vec3 v) {
+  if (v.y == 0.0f && v.z == 0.0f) {
+    return 0;
+  }
+  if (v.x == 0.0f && v.z == 0.0f) {
+    return 1;
+  }
+  if (v.x == 0.0f && v.y == 0.0f) {
+    return 2;
+  }
+  return -1;
+}
+
+// A rect's bounding box, over all four corners, as one that isn't
+// axis-aligned has them all apart.
+void rectBounds(Rect r, vec3* low, vec3* high) {
+  vec3 a = r.origin + r.da;
+  vec3 b = r.origin + r.db;
+  vec3 c = r.origin + r.da + r.db;
+  *low = glm::min(glm::min(r.origin, a), glm::min(b, c));
+  *high = glm::max(glm::max(r.origin, a), glm::max(b, c));
+}
+
+void gridBounds(int rect, int* first, int* last) {
+  vec3 low;
+  vec3 high;
+  rectBounds(rects[rect], &low, &high);
+  low -= GRID_EPSILON;
+  high += GRID_EPSILON;
+
+  for (int k = 0; k < 3; k++) {
+    first[k] = glm::clamp((int) floorf((low[k] - gridOrigin[k]) * gridCellInverse[k]), 0, gridCells[k] - 1);
+    last[k] = glm::clamp((int) floorf((high[k] - gridOrigin[k]) * gridCellInverse[k]), 0, gridCells[k] - 1);
+  }
+}
+
+int gridBucket(int rect) {
+  const AxisRect& a = axisRects[rect];
+  if (a.axis < 0) {
+    return GRID_BUCKETS - 1;
+  }
+  return 2 * a.axis + (a.n > 0.0f ? 0 : 1);
+}
+
+void buildGrid() {
+  vec3 low(HEMICUBE_FAR);
+  vec3 high(-HEMICUBE_FAR);
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    Rect r = rects[i];
+    vec3 rectLow;
+    vec3 rectHigh;
+    rectBounds(r, &rectLow, &rectHigh);
+    low = glm::min(low, rectLow);
+    high = glm::max(high, rectHigh);
+
+    AxisRect& a = axisRects[i];
+    a.axis = onlyAxis(normal(r));
+    a.uAxis = onlyAxis(r.da);
+    a.vAxis = onlyAxis(r.db);
+    if (a.axis < 0 || a.uAxis < 0 || a.vAxis < 0) {
+      a.axis = -1;
+      continue;
+    }
+    a.n = normal(r)[a.axis];
+    a.u = r.da[a.uAxis] / glm::dot(r.da, r.da);
+    a.v = r.db[a.vAxis] / glm::dot(r.db, r.db);
+  }
+
+  // Cubic cells, about GRID_CELLS_PER_RECT of them per rect.
+  low -= GRID_EPSILON;
+  high += GRID_EPSILON;
+  vec3 size = high - low;
+  float side = cbrtf(size.x * size.y * size.z / (GRID_CELLS_PER_RECT * ARRAY_LENGTH(rects)));
+  for (int k = 0; k < 3; k++) {
+    gridCells[k] = glm::max((int) ceilf(size[k] / side), 1);
+  }
+  gridOrigin = low;
+  gridCellSize = size / vec3(gridCells[0], gridCells[1], gridCells[2]);
+  gridCellInverse = 1.0f / gridCellSize;
+
+  // Counted first, then each bucket's start is the sum of those before it.
+  int buckets = gridCells[0] * gridCells[1] * gridCells[2] * GRID_BUCKETS;
+  gridStart = (int*) calloc(buckets + 1, sizeof(int));
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+      int first[3];
+      int last[3];
+      gridBounds(i, first, last);
+      int bucket = gridBucket(i);
+
+      for (int z = first[2]; z <= last[2]; z++) {
+        for (int y = first[1]; y <= last[1]; y++) {
+          for (int x = first[0]; x <= last[0]; x++) {
+            int b = ((z * gridCells[1] + y) * gridCells[0] + x) * GRID_BUCKETS + bucket;
+            if (pass == 0) {
+              gridStart[b + 1]++;
+            } else {
+              gridRects[gridStart[b]++] = i;
+            }
+          }
+        }
+      }
+    }
+
+    if (pass == 0) {
+      for (int b = 0; b < buckets; b++) {
+        gridStart[b + 1] += gridStart[b];
+      }
+      gridRects = (int*) malloc(sizeof(int) * glm::max(gridStart[buckets], 1));
+    } else {
+      // Filling moved each start up to the next's.
+      for (int b = buckets; b > 0; b--) {
+        gridStart[b] = gridStart[b - 1];
+      }
+      gridStart[0] = 0;
+    }
+  }
+
+  printf("Grid: %dx%dx%d cells, %d entries for %d rects\n",
+         gridCells[0], gridCells[1], gridCells[2], gridStart[buckets], (int) ARRAY_LENGTH(rects));
+}
+
+// intersectRects()'s test of one rect, for the grid.
+static inline void gridTest(int i, vec3 origin, vec3 direction, float* nearestT, int* nearest,
+                            float* hitU, float* hitV) {
+  const RectTable& r = rectTable;
+  const AxisRect& a = axisRects[i];
+  float t;
+  float u;
+  float v;
+
+  if (a.axis >= 0) {
+    float facing = a.n * direction[a.axis];
+    t = (r.d[i] - a.n * origin[a.axis]) / facing;
+    if (!(RAY_EPSILON < t && t <= *nearestT)) {
+      return;
+    }
+    u = a.u * (origin[a.uAxis] + direction[a.uAxis] * t) - r.uw[i];
+    v = a.v * (origin[a.vAxis] + direction[a.vAxis] * t) - r.vw[i];
+  } else {
+    float facing = r.nx[i] * direction.x + r.ny[i] * direction.y + r.nz[i] * direction.z;
+    if (!(facing < 0.0f)) {
+      return;
+    }
+    t = (r.d[i] - (r.nx[i] * origin.x + r.ny[i] * origin.y + r.nz[i] * origin.z)) / facing;
+    if (!(RAY_EPSILON < t && t <= *nearestT)) {
+      return;
+    }
+    float x = origin.x + direction.x * t;
+    float y = origin.y + direction.y * t;
+    float z = origin.z + direction.z * t;
+    u = r.ux[i] * x + r.uy[i] * y + r.uz[i] * z - r.uw[i];
+    v = r.vx[i] * x + r.vy[i] * y + r.vz[i] * z - r.vw[i];
+  }
+
+  // Cells aren't visited in rect order, so a tie goes to the lower rect
+  // here rather than to whichever came first.
+  if (0.0f <= u && u <= 1.0f && 0.0f <= v && v <= 1.0f
+      && (t < *nearestT || (*nearest >= 0 && i < *nearest))) {
+    *nearest = i;
+    *nearestT = t;
+    *hitU = u;
+    *hitV = v;
+  }
+}
+
+// intersectRects() through the grid.
+int intersectGrid(vec3 origin, vec3 direction, int skipA, int skipB, float maxT,
+                  float* hitU, float* hitV) {
+  // Where the ray is inside the grid, [start, end).
+  float start = 0.0f;
+  float end = maxT;
+  float inverse[3];
+  for (int k = 0; k < 3; k++) {
+    float low = gridOrigin[k];
+    float high = gridOrigin[k] + gridCells[k] * gridCellSize[k];
+    if (direction[k] == 0.0f) {
+      if (origin[k] < low || origin[k] > high) {
+        return -1;
+      }
+      continue;
+    }
+    inverse[k] = 1.0f / direction[k];
+    float t0 = (low - origin[k]) * inverse[k];
+    float t1 = (high - origin[k]) * inverse[k];
+    start = glm::max(start, glm::min(t0, t1));
+    end = glm::min(end, glm::max(t0, t1));
+  }
+  if (start > end) {
+    return -1;
+  }
+
+  int cell[3];
+  int step[3];
+  float next[3];
+  float delta[3];
+  int buckets[4];
+  int bucketCount = 0;
+
+  for (int k = 0; k < 3; k++) {
+    float p = origin[k] + direction[k] * start;
+    cell[k] = glm::clamp((int) floorf((p - gridOrigin[k]) * gridCellInverse[k]), 0, gridCells[k] - 1);
+
+    if (direction[k] == 0.0f) {
+      step[k] = 0;
+      next[k] = HUGE_VALF;
+      delta[k] = HUGE_VALF;
+      continue;
+    }
+    step[k] = direction[k] > 0.0f ? 1 : -1;
+    float boundary = gridOrigin[k] + (cell[k] + (step[k] > 0)) * gridCellSize[k];
+    next[k] = (boundary - origin[k]) * inverse[k];
+    delta[k] = gridCellSize[k] * fabsf(inverse[k]);
+
+    // Only rects facing back along the ray can be hit.
+    buckets[bucketCount++] = 2 * k + (step[k] > 0 ? 1 : 0);
+  }
+  buckets[bucketCount++] = GRID_BUCKETS - 1;
+
+  // Rects span cells, and each is tested once.
+  uint32_t tested[(ARRAY_LENGTH(rects) + 31) / 32] = {0};
+  if (skipA >= 0) {
+    tested[skipA / 32] |= 1u << (skipA % 32);
+  }
+  if (skipB >= 0) {
+    tested[skipB / 32] |= 1u << (skipB % 32);
+  }
+
+  int nearest = -1;
+  float nearestT = maxT;
+  int axis = onlyAxis(direction);
+
+  for (;;) {
+    int base = ((cell[2] * gridCells[1] + cell[1]) * gridCells[0] + cell[0]) * GRID_BUCKETS;
+    for (int b = 0; b < bucketCount; b++) {
+      for (int e = gridStart[base + buckets[b]]; e < gridStart[base + buckets[b] + 1]; e++) {
+        int i = gridRects[e];
+        if (tested[i / 32] & (1u << (i % 32))) {
+          continue;
+        }
+        tested[i / 32] |= 1u << (i % 32);
+        gridTest(i, origin, direction, &nearestT, &nearest, hitU, hitV);
+      }
+    }
+
+    // Along an axis there's only the one way to go.
+    int k = axis;
+    if (k < 0) {
+      k = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+    }
+
+    float exit = next[k];
+    if ((nearest >= 0 && nearestT <= exit) || exit >= end) {
+      break;
+    }
+
+    cell[k] += step[k];
+    if (cell[k] < 0 || cell[k] >= gridCells[k]) {
+      break;
+    }
+    next[k] += delta[k];
+  }
+
+  return nearest;
+}
+
+// The grid if --accel says, otherwise the kernel --kernel picks, for one
+// ray.
+int castRay(vec3 origin, vec3 direction, int skipA, int skipB, float maxT, float* hitU, float* hitV) {
+  if (accelMode == ACCEL_GRID) {
+    return intersectGrid(origin, direction, skipA, skipB, maxT, hitU, hitV);
+  } else if (kernelMode == KERNEL_SIMD) {
+    return intersectRectsWide(origin, direction, skipA, skipB, maxT, hitU, hitV);
+  } else {
+    return intersectRects(origin, direction, skipA, skipB, maxT, hitU, hitV);
+  }
+}
+
+// The first count rays of a packet. The grid takes them one by one, as
+// they soon part ways through it.
+void castPacket(RayPacket* packet, int count, int skipA, int skipB) {
+  if (kernelMode == KERNEL_SIMD && accelMode == ACCEL_BRUTE) {
+    for (int lane = count; lane < RAY_LANES; lane++) {
+      packet->maxT[lane] = 0.0f;
+    }
+    intersectPacket(packet, skipA, skipB);
+    return;
+  }
+
+  for (int lane = 0; lane < count; lane++) {
+    vec3 origin(packet->ox[lane], packet->oy[lane], packet->oz[lane]);
+    vec3 direction(packet->dx[lane], packet->dy[lane], packet->dz[lane]);
+    packet->hit[lane] = castRay(origin, direction, skipA, skipB, packet->maxT[lane],
+                                &packet->u[lane], &packet->v[lane]);
+  }
+}
+
+// Rays per second through each kernel and the grid on one thread, from
+// random points on the rects, RAY_LANES to a point as a gathering texel
+// casts them. The first set go in cosine weighted directions, the second
+// along axes.
+void benchmarkRays() {
+  const int points = 8192;
+  const int count = points * RAY_LANES;
+  const int rounds = 20;
+
+  RayPacket* packets = (RayPacket*) malloc(sizeof(RayPacket) * points);
+  int* skips = (int*) malloc(sizeof(int) * points);
+  int* reference = (int*) malloc(sizeof(int) * count);
+
+  printf("%d rays from %d points, %d rects, %d lanes\n", count, points, (int) ARRAY_LENGTH(rects), RAY_LANES);
+
+  const char* sets[] = {"cosine", "axis"};
+  for (int set = 0; set < ARRAY_LENGTH(sets); set++) {
+    for (int p = 0; p < points; p++) {
+      int i = rand() % ARRAY_LENGTH(rects);
+      Rect rect = rects[i];
+      vec3 n = normal(rect);
+      vec3 tangent = glm::normalize(rect.da);
+      vec3 bitangent = glm::cross(n, tangent);
+      vec3 origin = rect.origin + rect.da * ((float) rand() / RAND_MAX) + rect.db * ((float) rand() / RAND_MAX);
+      skips[p] = i;
+
+      for (int lane = 0; lane < RAY_LANES; lane++) {
+        vec3 direction;
+        if (set == 0) {
+          float s = (float) rand() / RAND_MAX;
+          float angle = 2.0f * glm::pi<float>() * rand() / RAND_MAX;
+          direction = tangent * (sqrtf(s) * cosf(angle)) + bitangent * (sqrtf(s) * sinf(angle)) + n * sqrtf(1.0f - s);
+        } else {
+          // Any axis direction not into the rect.
+          do {
+            direction = vec3(0.0f);
+            direction[rand() % 3] = rand() % 2 ? 1.0f : -1.0f;
+          } while (glm::dot(direction, n) < 0.0f);
+        }
+
+        packets[p].ox[lane] = origin.x;
+        packets[p].oy[lane] = origin.y;
+        packets[p].oz[lane] = origin.z;
+        packets[p].dx[lane] = direction.x;
+        packets[p].dy[lane] = direction.y;
+        packets[p].dz[lane] = direction.z;
+        packets[p].maxT[lane] = HEMICUBE_FAR;
+      }
+    }
+
+    const char* names[] = {"scalar", "wide", "packet", "grid"};
+    for (int kernel = 0; kernel < ARRAY_LENGTH(names); kernel++) {
+      long checksum = 0;
+      int differ = 0;
+      Uint64 start = 0;
+
+      // The first round is an untimed warm-up, and the one checked.
+      for (int round = 0; round <= rounds; round++) {
+        if (round == 1) {
+          start = SDL_GetPerformanceCounter();
+        }
+
+        for (int p = 0; p < points; p++) {
+          RayPacket* packet = &packets[p];
+          if (kernel == 2) {
+            intersectPacket(packet, skips[p], skips[p]);
+          } else {
+            for (int lane = 0; lane < RAY_LANES; lane++) {
+              vec3 origin(packet->ox[lane], packet->oy[lane], packet->oz[lane]);
+              vec3 direction(packet->dx[lane], packet->dy[lane], packet->dz[lane]);
+              float* u = &packet->u[lane];
+              float* v = &packet->v[lane];
+              packet->hit[lane] = kernel == 0 ? intersectRects(origin, direction, skips[p], skips[p], HEMICUBE_FAR, u, v)
+                : kernel == 1 ? intersectRectsWide(origin, direction, skips[p], skips[p], HEMICUBE_FAR, u, v)
+                : intersectGrid(origin, direction, skips[p], skips[p], HEMICUBE_FAR, u, v);
+            }
+          }
+
+          for (int lane = 0; lane < RAY_LANES; lane++) {
+            checksum += packet->hit[lane];
+            if (round == 0) {
+              if (kernel == 0) {
+                reference[p * RAY_LANES + lane] = packet->hit[lane];
+              } else if (packet->hit[lane] != reference[p * RAY_LANES + lane]) {
+                differ++;
+              }
+            }
+          }
+        }
+      }
+      float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+      printf("%-6s %-6s %8.2f Mrays/s %8.1f ns/ray (%d differ from scalar, checksum %ld)\n",
+             sets[set], names[kernel],
+             (float) count * rounds / seconds / 1e6,
+             seconds / ((float) count * rounds) * 1e9,
+             differ, checksum);
+    }
+  }
+
+  free(packets);
+  free(skips);
+  free(reference);
+}
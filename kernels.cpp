@@ -0,0 +1,134 @@
+#if defined(__SSE__)
+#include <immintrin.h>
+
+// A pixel's channels in the low three lanes. The top lane picks up the
+// float after the pixel and is never used.
+static inline __m128 loadPixel(const Color* p) {
+  return _mm_loadu_ps(&p->r);
+}
+#endif
+
+// Weighted sum over a hemicube stored as bands of resolution x resolution
+// pixels, with weights for one quadrant per band (see multiplierMap). Every
+// weight is shared by four mirrored pixels, which are added up first so
+// each weight is read and multiplied once.
+//
+// The SIMD path adds each pair of mirrored rows at full vector width, then
+// folds the result about its middle. That half runs pixels backwards, so it
+// keeps one pixel per vector, with four accumulators so the adds don't wait
+// on each other.
+//
+// FIXED_R is the resolution when it is known at compile time, so the row
+// loops run a constant number of times, or 0 to take it from resolution.
+template <int FIXED_R, int BANDS>
+Color foldedWeightedSum(const Color* data, const float* quadrants, int resolution) {
+  const int R = FIXED_R ? FIXED_R : resolution;
+  const int H = R / 2;
+
+#if defined(__SSE__)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps();
+  __m128 acc3 = _mm_setzero_ps();
+
+  // One folded row plus a float of slack for the last pixel's top lane.
+  float folded[MAX_HEMICUBE_RESOLUTION * 3 + 1];
+  const Color* row = (const Color*) folded + H;
+
+  for (int band = 0; band < BANDS; band++) {
+    for (int qy = 0; qy < H; qy++) {
+      const float* above = &data[(band*R + H + qy) * R].r;
+      const float* below = &data[(band*R + H - 1 - qy) * R].r;
+      const float* weights = quadrants + (band*H + qy) * H;
+
+      // Fold the two rows together at full vector width first...
+      int f = 0;
+#if defined(__AVX__)
+      for (; f + 8 <= R * 3; f += 8) {
+        _mm256_storeu_ps(folded + f, _mm256_add_ps(_mm256_loadu_ps(above + f), _mm256_loadu_ps(below + f)));
+      }
+#endif
+      for (; f + 4 <= R * 3; f += 4) {
+        _mm_storeu_ps(folded + f, _mm_add_ps(_mm_loadu_ps(above + f), _mm_loadu_ps(below + f)));
+      }
+      for (; f < R * 3; f++) {
+        folded[f] = above[f] + below[f];
+      }
+
+      // ...then the row about its middle, one pixel per vector.
+      int qx = 0;
+      for (; qx + 4 <= H; qx += 4) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_add_ps(loadPixel(row + qx), loadPixel(row - 1 - qx)), _mm_load1_ps(weights + qx)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_add_ps(loadPixel(row + qx + 1), loadPixel(row - 2 - qx)), _mm_load1_ps(weights + qx + 1)));
+        acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_add_ps(loadPixel(row + qx + 2), loadPixel(row - 3 - qx)), _mm_load1_ps(weights + qx + 2)));
+        acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_add_ps(loadPixel(row + qx + 3), loadPixel(row - 4 - qx)), _mm_load1_ps(weights + qx + 3)));
+      }
+      for (; qx < H; qx++) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_add_ps(loadPixel(row + qx), loadPixel(row - 1 - qx)), _mm_load1_ps(weights + qx)));
+      }
+    }
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+
+  Color result = {lanes[0], lanes[1], lanes[2]};
+  return result;
+#else
+  Color result = {0.0f, 0.0f, 0.0f};
+
+  for (int band = 0; band < BANDS; band++) {
+    for (int qy = 0; qy < H; qy++) {
+      const Color* above = data + (band*R + H + qy) * R + H;
+      const Color* below = data + (band*R + H - 1 - qy) * R + H;
+      const float* weights = quadrants + (band*H + qy) * H;
+
+      for (int qx = 0; qx < H; qx++) {
+        float w = weights[qx];
+        result.r += (above[qx].r + above[-1 - qx].r + below[qx].r + below[-1 - qx].r) * w;
+        result.g += (above[qx].g + above[-1 - qx].g + below[qx].g + below[-1 - qx].g) * w;
+        result.b += (above[qx].b + above[-1 - qx].b + below[qx].b + below[-1 - qx].b) * w;
+      }
+    }
+  }
+
+  return result;
+#endif
+}
+
+// Weighted sum of count pixels with a weight each, for maps without the
+// hemicube's symmetry.
+Color weightedPixelSum(const Color* data, const float* weights, int count) {
+  Color result = {0.0f, 0.0f, 0.0f};
+  int i = 0;
+
+#if defined(__SSE__)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps();
+  __m128 acc3 = _mm_setzero_ps();
+
+  // The last pixel is left to the scalar loop, as its top lane would read
+  // past the end.
+  for (; i + 4 < count; i += 4) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(loadPixel(data + i), _mm_load1_ps(weights + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(loadPixel(data + i + 1), _mm_load1_ps(weights + i + 1)));
+    acc2 = _mm_add_ps(acc2, _mm_mul_ps(loadPixel(data + i + 2), _mm_load1_ps(weights + i + 2)));
+    acc3 = _mm_add_ps(acc3, _mm_mul_ps(loadPixel(data + i + 3), _mm_load1_ps(weights + i + 3)));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, _mm_add_ps(_mm_add_ps(acc0, acc1), _mm_add_ps(acc2, acc3)));
+  result.r = lanes[0];
+  result.g = lanes[1];
+  result.b = lanes[2];
+#endif
+
+  for (; i < count; i++) {
+    result.r += data[i].r * weights[i];
+    result.g += data[i].g * weights[i];
+    result.b += data[i].b * weights[i];
+  }
+
+  return result;
+}
@@ -1,6 +1,22 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <SDL.h>
+
+// Headless builds bake without a window or display: Mesa's surfaceless EGL
+// platform gives a context that only renders into framebuffer objects.
+// SDL is still used for timers, which don't need its video subsystem.
+#if defined(HEADLESS)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+#else
 #include <OpenGL/gl3.h>
+#endif
 
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -19,36 +35,277 @@
 
 using glm::vec3;
 
-#define HEMICUBE_RESOLUTION 50
-const int HEMICUBE_TEXTURE_WIDTH = HEMICUBE_RESOLUTION;
-const int HEMICUBE_TEXTURE_HEIGHT = HEMICUBE_RESOLUTION*3;
+// Set from the command line so quality can be traded against speed
+// without recompiling.
+int hemicubeResolution = 50;
+int hemicubeTextureWidth;
+int hemicubeTextureHeight;
+
+int texelDensity = 4;
+int passes = 8;
+
+#define MAX_HEMICUBE_RESOLUTION 512
+
+#define HEMICUBE_NEAR 0.05f
+#define HEMICUBE_FAR 100.0f
+
+// Where each face sits in a hemicube of resolution R.
+#define TOP_X(R) 0
+#define TOP_Y(R) 0
+#define BOTTOM_X(R) 0
+#define BOTTOM_Y(R) ((R)/2)
+#define LEFT_X(R) 0
+#define LEFT_Y(R) (R)
+#define RIGHT_X(R) ((R)/2)
+#define RIGHT_Y(R) (R)
+#define FRONT_X(R) 0
+#define FRONT_Y(R) ((R)*2)
+
+#define MAX_READBACK_RING 16
+#define MAX_BATCH 256
+
+enum ReadbackMode {
+  READBACK_SYNC,
+  READBACK_PBO
+};
+
+ReadbackMode readbackMode = READBACK_PBO;
+int readbackRingSize = 4;
+
+// Hemicubes rendered side by side into one atlas before a single readback.
+int batchSize = 1;
+int batchColumns;
+int batchRows;
+
+#define REDUCE_BLOCK 4
+#define MAX_REDUCE_LEVELS 8
+
+enum ReduceMode {
+  REDUCE_CPU,
+  REDUCE_GPU
+};
+
+ReduceMode reduceMode = REDUCE_CPU;
+
+#define HEMICUBE_FACES 5
+
+enum HemicubeRenderMode {
+  HEMICUBE_MULTIPASS,
+  HEMICUBE_LAYERED
+};
+
+HemicubeRenderMode hemicubeRenderMode = HEMICUBE_MULTIPASS;
+
+enum KernelMode {
+  KERNEL_SCALAR,
+  KERNEL_SIMD
+};
+
+KernelMode kernelMode = KERNEL_SIMD;
+
+// How visibility on the CPU finds what a ray hits: by testing every rect,
+// or by walking a uniform grid of them (see intersect.cpp).
+enum AccelMode {
+  ACCEL_BRUTE,
+  ACCEL_GRID
+};
+
+AccelMode accelMode = ACCEL_BRUTE;
+
+bool benchmarkKernelsOnly = false;
+bool benchmarkRaysOnly = false;
+
+// Adaptive mode renders each texel's hemicube at one of a few levels,
+// halving down from hemicubeResolution. Texels go up from the lowest level
+// when a low resolution pre-render finds geometry close by, and when their
+// last hemicube got its light from a few bright pixels, which is where a
+// coarse hemicube gets the answer wrong (see chooseLevel()).
+#define MAX_HEMICUBE_LEVELS 3
+#define PROBE_RESOLUTION 16
+#define ADAPTIVE_NEAR_DISTANCE 0.5f
+#define ADAPTIVE_VARIATION 8.0f
+
+bool adaptiveResolution = false;
+
+// What each texel's view of the scene is projected onto. The hemicube
+// takes five renders; the hemisphere takes one, projecting straight down
+// onto the base (Nusselt's analog) so every pixel inside the circle carries
+// the same form factor; the tetrahedron takes three, the faces of the cube
+// corner standing on its tip over the surface.
+enum ProjectionMode {
+  PROJECTION_HEMICUBE,
+  PROJECTION_HEMISPHERE,
+  PROJECTION_TETRAHEDRON
+};
+
+ProjectionMode projectionMode = PROJECTION_HEMICUBE;
+
+const char* projectionNames[] = {"hemicube", "hemisphere", "tetrahedron"};
+
+// The hemisphere's projection bends straight edges, so it draws a mesh
+// with every rect cut into cells no bigger than this.
+#define HEMISPHERE_CELL_SIZE 0.25f
+
+bool compareProjectionsOnly = false;
+
+// Visibility doesn't change between passes, only the colors seen. In form
+// factor mode the first pass renders which texel each pixel sees, the
+// weights are summed per texel into a sparse matrix, and every pass is
+// then that matrix times the lightmaps on the CPU. Ray casting and
+// rasterizing gather on the CPU with no GL at all, over gatherThreads
+// threads, by default one per core: ray casting with raysPerTexel rays per
+// texel (see raycast.cpp), rasterizing with a hemicube per texel like
+// rendering's (see raster.cpp).
+enum GatherMode {
+  GATHER_RENDER,
+  GATHER_FORM_FACTORS,
+  GATHER_RAYCAST,
+  GATHER_RASTER
+};
+
+GatherMode gatherMode = GATHER_RENDER;
+int raysPerTexel = 1024;
+int gatherThreads = 0;
+
+// Gathering updates every texel each pass. Shooting instead takes the
+// texel with the most light not yet passed on, renders a hemicube from it
+// and hands that light to every texel it sees, until what is left is below
+// SHOOT_THRESHOLD of what the emitters started with, or it has rendered as
+// many hemicubes as passes of gathering would have. The hierarchical
+// solver gathers on the CPU between patches of every size, with no
+// hemicubes (see hierarchical.cpp).
+enum SolverMode {
+  SOLVER_GATHER,
+  SOLVER_SHOOT,
+  SOLVER_HIERARCHICAL
+};
+
+SolverMode solverMode = SOLVER_GATHER;
+
+#define SHOOT_THRESHOLD 0.001f
+
+// With a tolerance set, passes stop as soon as the relative residual (what
+// the last pass changed against the light reflected so far) is below it,
+// over the whole scene or on every rect; --passes is then only a limit.
+// Each pass changes the light by roughly a constant ratio of the last
+// one's change, so the rest of the series can be estimated and, with
+// --extrapolate, added on at the end (Aitken's delta-squared).
+enum ResidualMode {
+  RESIDUAL_GLOBAL,
+  RESIDUAL_RECT
+};
+
+ResidualMode residualMode = RESIDUAL_GLOBAL;
+float tolerance = 0.0f;
+bool extrapolate = false;
+
+#define MAX_CONVERGE_PASSES 100
+#define MAX_EXTRAPOLATION_RATIO 0.9f
+
+// Jacobi updates gather from the lightmaps as the last pass left them, as
+// the textures are only loaded between passes. Gauss-Seidel loads each
+// rect's texels as soon as the rect is done, so rects later in the same
+// pass gather its new light. Its updates can be over-relaxed, moving each
+// texel past its gathered value by a factor of relaxation.
+enum UpdateMode {
+  UPDATE_JACOBI,
+  UPDATE_GAUSS_SEIDEL
+};
+
+UpdateMode updateMode = UPDATE_JACOBI;
+float relaxation = 1.0f;
+
+// Full sampling renders a hemicube for every texel. Adaptive sampling
+// renders them on a grid SUBDIVIDE_SPACING texels apart, and splits each
+// cell of the grid in four, rendering the new corners, for as long as its
+// corners' irradiance differs by more than SUBDIVIDE_CONTRAST of their
+// mean, or it is large next to the distance to the nearest surface in
+// front of it, where light changes quickly. The other texels are
+// interpolated from the corners of the smallest cell around them.
+enum SamplingMode {
+  SAMPLING_FULL,
+  SAMPLING_ADAPTIVE
+};
+
+SamplingMode samplingMode = SAMPLING_FULL;
+
+// Before the first pass, the lightmaps can be seeded from a solve at the
+// level of whole rects: the form factor between every pair of rects from
+// WARM_START_SAMPLES x WARM_START_SAMPLES item hemicubes spread over each
+// rect, and the small dense system solved directly.
+#define WARM_START_SAMPLES 3
+
+bool warmStart = false;
+
+// Skipping settled texels keeps each texel's residual, the last change a
+// gather made to it relative to its value, across passes. Once it has
+// been under SETTLED_CHANGE for SETTLED_PASSES gathers in a row the texel
+// is left as it is, except on every SETTLED_REVALIDATE'th pass, which
+// gathers everything again. Two gathers, so texels in shadow, which
+// change by nothing in the first pass, still get the second's bounce.
+#define SETTLED_CHANGE 0.001f
+#define SETTLED_PASSES 2
+#define SETTLED_REVALIDATE 4
+
+bool skipSettled = false;
+
+// Where the finished lightmaps are written, one PFM file per rect.
+// Headless bakes always write them.
+const char* outputDirectory = NULL;
+
+#define HEADLESS_OUTPUT_DIRECTORY "lightmaps"
+
+// Passes at lower texel densities before those at texelDensity, each
+// level's lightmaps upsampled into the next as where it starts from.
+#define MAX_SCHEDULE_LEVELS 4
 
-const int TOP_X = 0;
-const int TOP_Y = 0;
-const int BOTTOM_X = 0;
-const int BOTTOM_Y = HEMICUBE_RESOLUTION/2;
-const int LEFT_X = 0;
-const int LEFT_Y = HEMICUBE_RESOLUTION;
-const int RIGHT_X = HEMICUBE_RESOLUTION/2;
-const int RIGHT_Y = HEMICUBE_RESOLUTION;
-const int FRONT_X = 0;
-const int FRONT_Y = HEMICUBE_RESOLUTION*2;
+struct ScheduleLevel {
+  int density;
+  int passes;
+};
+
+ScheduleLevel schedule[MAX_SCHEDULE_LEVELS];
+int scheduleLength = 0;
 
-#define TEXEL_DENSITY 4
-#define PASSES 8
+#define SUBDIVIDE_SPACING 8
+#define SUBDIVIDE_CONTRAST 0.25f
+#define SUBDIVIDE_CLEARANCE 1.0f
 
+void parseArguments(int argc, char** argv);
 void setWindowSize();
 void renderScene();
 void radiosify();
 void hemicubeSetup();
+void reduceSetup();
+void layeredSetup();
 void loadTextures();
+void updateTexture(int rect);
 void tick();
 GLuint createShader(const char* name, GLenum shaderType);
 void render(glm::mat4 camera, GLuint program);
-void renderHemicube(vec3 location, vec3 normal);
+void renderHemicube(GLuint frameBuffer, int originX, int originY, vec3 location, vec3 normal, int resolution);
 void setDisplaySize(int width, int height);
 void generateTextures();
 void prepareMultiplierMap();
+void benchmarkKernels();
+void probeTexels();
+void hemisphereSetup();
+void renderProjection(GLuint frameBuffer, int originX, int originY, vec3 location, vec3 normal, int resolution);
+void resetTextureData();
+void compareProjections();
+void formFactorSetup();
+void subdivisionSetup();
+void warmStartRects();
+void setTexelDensity(int density);
+void settleSetup();
+bool createHeadlessContext();
+void writeLightmaps(const char* directory);
+void prepareFormFactors();
+void applyFormFactors();
+void shoot();
+void beginPass();
+bool converged(int pass);
+void extrapolateLight();
 
 bool quit = false;
 
@@ -67,6 +324,21 @@ GLuint vao;
 GLuint programs[2];
 int currentProgram = 1;
 
+GLuint reduceProgram;
+GLuint reduceVao;
+
+GLuint layeredProgram;
+
+GLuint itemProgram;
+
+// Set while form factor mode renders texel ids instead of colors.
+bool renderItems = false;
+
+GLuint hemisphereProgram;
+GLuint hemisphereItemProgram;
+GLuint hemisphereVbo;
+GLuint hemisphereVao;
+
 #define POSITION_ATTRIB 0
 #define NORMAL_ATTRIB 1
 #define COLOR_ATTRIB 2
@@ -123,17 +395,100 @@ const Color BLACK = {0.0f, 0.0f, 0.0f};
 const Color SUN = {1000.0f, 850.0f, 900.0f};
 
 #include "geometry.cpp"
+#include "kernels.cpp"
 
 GLuint textures[ARRAY_LENGTH(rects)];
 Color *textureData[ARRAY_LENGTH(rects)];
 
-Color hemicubeAverage();
+// For adaptive resolution: the nearest geometry each texel sees, and how
+// much its last hemicube varied (see hemicubeVariation()).
+float* texelDistance[ARRAY_LENGTH(rects)];
+float* texelVariation[ARRAY_LENGTH(rects)];
+
+// For adaptive sampling: the irradiance each texel last gathered, and how
+// far it is from the nearest surface in front of it.
+Color* texelIrradiance[ARRAY_LENGTH(rects)];
+float* texelClearance[ARRAY_LENGTH(rects)];
+
+// For skipping settled texels: each texel's residual, how many gathers in
+// a row it has been under SETTLED_CHANGE, and the counts for this pass.
+float* texelResidual[ARRAY_LENGTH(rects)];
+unsigned char* texelStable[ARRAY_LENGTH(rects)];
+int settledPass;
+int passSkipped;
+bool revalidating;
+
+struct HemicubeSample {
+  int rect;
+  int x;
+  int y;
+  int level;
+};
+
+// One in-flight batch of hemicubes: its own atlas render target, plus a
+// pixel buffer the readback is copied into so the CPU only waits on it once
+// the GPU is done.
+struct HemicubeSlot {
+  GLuint frameBuffer;
+  GLuint colorBuffer;
+  GLuint depthBuffer;
+  GLuint pixelBuffer;
+  bool pending;
+  int sampleCount;
+  HemicubeSample samples[MAX_BATCH];
+};
+
+HemicubeSlot hemicubeSlots[MAX_READBACK_RING];
+int nextHemicubeSlot = 0;
+
+// Synchronous readback target: batchSize hemicubes, one after the other.
+Color* hemicubeTextureData;
+
+float passError;
+
+void readHemicubes(HemicubeSlot* slot);
+void finishHemicubes(HemicubeSlot* slot);
+void flushHemicubes();
+void storeSample(HemicubeSample sample, Color avg);
+Color sampledColor(Color c);
+void beginSettling();
+bool texelSettled(int rect, int index);
+void reportSettling(int texels);
+Color rasterHemicube(HemicubeSample sample, int worker);
+vec3 upFor(vec3 normal);
+void fillMultiplierMap(float* multiplierMap, int resolution);
+
+#include "intersect.cpp"
+#include "hierarchical.cpp"
+#include "raycast.cpp"
+#include "raster.cpp"
 
 int main(int argc, char** argv) {
   setbuf(stdout, NULL);
 
+  parseArguments(argc, argv);
+
+  if (benchmarkKernelsOnly) {
+    prepareMultiplierMap();
+    benchmarkKernels();
+    return 0;
+  }
+
   buildMesh();
+  buildRectTable();
+  if (accelMode == ACCEL_GRID || benchmarkRaysOnly) {
+    buildGrid();
+  }
+
+  if (benchmarkRaysOnly) {
+    benchmarkRays();
+    return 0;
+  }
 
+#if defined(HEADLESS)
+  if (!createHeadlessContext()) fail;
+  printf("Renderer: %s\n", glGetString(GL_RENDERER));
+#else
   if (SDL_Init(SDL_INIT_VIDEO) < 0) fail;
 
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
@@ -152,6 +507,7 @@ int main(int argc, char** argv) {
   glEnable(GL_FRAMEBUFFER_SRGB);
 
   SDL_SetRelativeMouseMode(SDL_TRUE);
+#endif
 
   prepareMultiplierMap();
 
@@ -244,6 +600,30 @@ int main(int argc, char** argv) {
   loadTextures();
 
   hemicubeSetup();
+  if (reduceMode == REDUCE_GPU) {
+    reduceSetup();
+  }
+  if (hemicubeRenderMode == HEMICUBE_LAYERED) {
+    layeredSetup();
+  }
+  if (projectionMode == PROJECTION_HEMISPHERE || compareProjectionsOnly) {
+    hemisphereSetup();
+  }
+  if (gatherMode == GATHER_FORM_FACTORS || solverMode == SOLVER_SHOOT || warmStart) {
+    formFactorSetup();
+  }
+  if (samplingMode == SAMPLING_ADAPTIVE) {
+    subdivisionSetup();
+  }
+  if (skipSettled) {
+    settleSetup();
+  }
+  if (gatherMode == GATHER_RAYCAST || gatherMode == GATHER_RASTER || compareProjectionsOnly) {
+    cpuGatherSetup();
+  }
+  if (gatherMode == GATHER_RASTER || compareProjectionsOnly) {
+    rasterSetup();
+  }
 
   glEnable(GL_DEPTH_TEST);
   glDepthMask(GL_TRUE);
@@ -254,23 +634,412 @@ int main(int argc, char** argv) {
   glFrontFace(GL_CW);
   glCullFace(GL_BACK);
 
-  for (int i = 0; i < PASSES; i++) {
+  if (compareProjectionsOnly) {
+    compareProjections();
+    return 0;
+  }
+
+  if (adaptiveResolution) {
+    probeTexels();
+  }
+
+  const int finalDensity = texelDensity;
+  if (scheduleLength > 0) {
+    setTexelDensity(schedule[0].density);
+  }
+
+  if (warmStart) {
+    warmStartRects();
+  }
+  loadTextures();
+
+  float levelSeconds[MAX_SCHEDULE_LEVELS + 1];
+  for (int level = 0; level < scheduleLength; level++) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    // The level's first pass gathers from textures at its own density.
+    setTexelDensity(schedule[level].density);
+    loadTextures();
+    for (int i = 0; i < schedule[level].passes; i++) {
+      printf("Pass %d at density %d\n", i+1, texelDensity);
+      radiosify();
+      loadTextures();
+      setWindowSize();
+      renderScene();
+    }
+    levelSeconds[level] = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  }
+  if (scheduleLength > 0) {
+    setTexelDensity(finalDensity);
+    loadTextures();
+  }
+
+  Uint64 finalStart = SDL_GetPerformanceCounter();
+
+  if (solverMode == SOLVER_SHOOT) {
+    shoot();
+    passes = 0;
+  }
+
+  for (int i = 0; i < passes; i++) {
     printf("Pass %d\n", i+1);
-    radiosify();
+    beginPass();
+    if (solverMode == SOLVER_HIERARCHICAL) {
+      if (i == 0) {
+        hierarchySetup();
+      }
+      hierarchicalPass();
+    } else if (gatherMode == GATHER_FORM_FACTORS) {
+      if (i == 0) {
+        prepareFormFactors();
+      }
+      applyFormFactors();
+    } else if (gatherMode == GATHER_RAYCAST || gatherMode == GATHER_RASTER) {
+      cpuGatherPass();
+    } else {
+      radiosify();
+    }
+
+    bool done = converged(i);
+    if (extrapolate && (done || i == passes - 1)) {
+      extrapolateLight();
+    }
+
     loadTextures();
     setWindowSize();
     renderScene();
+
+    if (done) {
+      break;
+    }
+  }
+
+  if (scheduleLength > 0) {
+    levelSeconds[scheduleLength] = (float) (SDL_GetPerformanceCounter() - finalStart) / SDL_GetPerformanceFrequency();
+    float total = 0.0f;
+    for (int level = 0; level <= scheduleLength; level++) {
+      total += levelSeconds[level];
+    }
+    for (int level = 0; level <= scheduleLength; level++) {
+      bool last = level == scheduleLength;
+      printf("Density %d: %d passes in %.2fs, %.1f%%\n",
+             last ? texelDensity : schedule[level].density, last ? passes : schedule[level].passes,
+             levelSeconds[level], 100.0f * levelSeconds[level] / total);
+    }
+  }
+
+  if (outputDirectory) {
+    writeLightmaps(outputDirectory);
   }
 
+#if !defined(HEADLESS)
   setWindowSize();
 
   while (!quit) {
     tick();
   }
+#endif
 
   return 0;
 }
 
+void parseArguments(int argc, char** argv) {
+  bool passesGiven = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+
+    if (!strcmp(arg, "--readback=sync")) {
+      readbackMode = READBACK_SYNC;
+    } else if (!strcmp(arg, "--readback=pbo")) {
+      readbackMode = READBACK_PBO;
+    } else if (!strcmp(arg, "--reduce=cpu")) {
+      reduceMode = REDUCE_CPU;
+    } else if (!strcmp(arg, "--reduce=gpu")) {
+      reduceMode = REDUCE_GPU;
+    } else if (!strcmp(arg, "--kernel=scalar")) {
+      kernelMode = KERNEL_SCALAR;
+    } else if (!strcmp(arg, "--kernel=simd")) {
+      kernelMode = KERNEL_SIMD;
+    } else if (!strcmp(arg, "--bench-kernel")) {
+      benchmarkKernelsOnly = true;
+    } else if (!strcmp(arg, "--accel=brute")) {
+      accelMode = ACCEL_BRUTE;
+    } else if (!strcmp(arg, "--accel=grid")) {
+      accelMode = ACCEL_GRID;
+    } else if (!strcmp(arg, "--bench-rays")) {
+      benchmarkRaysOnly = true;
+    } else if (!strncmp(arg, "--resolution=", 13)) {
+      hemicubeResolution = atoi(arg + 13);
+      if (hemicubeResolution < 2 || hemicubeResolution > MAX_HEMICUBE_RESOLUTION || hemicubeResolution % 2) {
+        printf("--resolution must be even and between 2 and %d\n", MAX_HEMICUBE_RESOLUTION);
+        exit(1);
+      }
+    } else if (!strncmp(arg, "--density=", 10)) {
+      texelDensity = atoi(arg + 10);
+      // The hemicube's near plane has to stay within half a texel of the
+      // surface (see renderHemicube()).
+      if (texelDensity < 1 || !(HEMICUBE_NEAR < 0.5f / texelDensity)) {
+        printf("--density must be at least 1 and below %g\n", 0.5f / HEMICUBE_NEAR);
+        exit(1);
+      }
+    } else if (!strncmp(arg, "--passes=", 9)) {
+      passes = atoi(arg + 9);
+      if (passes < 1) {
+        printf("--passes must be at least 1\n");
+        exit(1);
+      }
+      passesGiven = true;
+    } else if (!strncmp(arg, "--tolerance=", 12)) {
+      tolerance = atof(arg + 12);
+      if (tolerance <= 0.0f || tolerance >= 1.0f) {
+        printf("--tolerance must be between 0 and 1\n");
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--residual=global")) {
+      residualMode = RESIDUAL_GLOBAL;
+    } else if (!strcmp(arg, "--residual=rect")) {
+      residualMode = RESIDUAL_RECT;
+    } else if (!strcmp(arg, "--extrapolate")) {
+      extrapolate = true;
+    } else if (!strcmp(arg, "--update=jacobi")) {
+      updateMode = UPDATE_JACOBI;
+    } else if (!strcmp(arg, "--update=gauss-seidel")) {
+      updateMode = UPDATE_GAUSS_SEIDEL;
+    } else if (!strncmp(arg, "--relax=", 8)) {
+      relaxation = atof(arg + 8);
+      if (relaxation <= 0.0f || relaxation >= 2.0f) {
+        printf("--relax must be between 0 and 2\n");
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--adaptive")) {
+      adaptiveResolution = true;
+    } else if (!strcmp(arg, "--projection=hemicube")) {
+      projectionMode = PROJECTION_HEMICUBE;
+    } else if (!strcmp(arg, "--projection=hemisphere")) {
+      projectionMode = PROJECTION_HEMISPHERE;
+    } else if (!strcmp(arg, "--projection=tetrahedron")) {
+      projectionMode = PROJECTION_TETRAHEDRON;
+    } else if (!strcmp(arg, "--gather=render")) {
+      gatherMode = GATHER_RENDER;
+    } else if (!strcmp(arg, "--gather=form-factors")) {
+      gatherMode = GATHER_FORM_FACTORS;
+    } else if (!strcmp(arg, "--gather=raycast")) {
+      gatherMode = GATHER_RAYCAST;
+    } else if (!strcmp(arg, "--gather=raster")) {
+      gatherMode = GATHER_RASTER;
+    } else if (!strncmp(arg, "--rays=", 7)) {
+      raysPerTexel = atoi(arg + 7);
+      if (raysPerTexel < 1) {
+        printf("--rays must be at least 1\n");
+        exit(1);
+      }
+    } else if (!strncmp(arg, "--threads=", 10)) {
+      gatherThreads = atoi(arg + 10);
+      if (gatherThreads < 1 || gatherThreads > MAX_GATHER_THREADS) {
+        printf("--threads must be between 1 and %d\n", MAX_GATHER_THREADS);
+        exit(1);
+      }
+    } else if (!strcmp(arg, "--solver=gather")) {
+      solverMode = SOLVER_GATHER;
+    } else if (!strcmp(arg, "--solver=shoot")) {
+      solverMode = SOLVER_SHOOT;
+    } else if (!strcmp(arg, "--solver=hierarchical")) {
+      solverMode = SOLVER_HIERARCHICAL;
+    } else if (!strcmp(arg, "--sampling=full")) {
+      samplingMode = SAMPLING_FULL;
+    } else if (!strcmp(arg, "--sampling=adaptive")) {
+      samplingMode = SAMPLING_ADAPTIVE;
+    } else if (!strncmp(arg, "--schedule=", 11)) {
+      const char* level = arg + 11;
+      scheduleLength = 0;
+      while (*level) {
+        char* end;
+        int density = strtol(level, &end, 10);
+        int count = *end == ':' ? strtol(end + 1, &end, 10) : 0;
+        if (density < 1 || count < 1 || (*end && *end != ',') || scheduleLength == MAX_SCHEDULE_LEVELS) {
+          printf("--schedule takes up to %d density:passes pairs, like --schedule=1:2,2:2\n", MAX_SCHEDULE_LEVELS);
+          exit(1);
+        }
+        ScheduleLevel l = {density, count};
+        schedule[scheduleLength++] = l;
+        level = *end ? end + 1 : end;
+      }
+    } else if (!strncmp(arg, "--output=", 9)) {
+      outputDirectory = arg + 9;
+    } else if (!strcmp(arg, "--skip-settled")) {
+      skipSettled = true;
+    } else if (!strcmp(arg, "--warm-start")) {
+      warmStart = true;
+    } else if (!strcmp(arg, "--compare-projections")) {
+      compareProjectionsOnly = true;
+    } else if (!strcmp(arg, "--layered")) {
+      hemicubeRenderMode = HEMICUBE_LAYERED;
+    } else if (!strncmp(arg, "--batch=", 8)) {
+      batchSize = atoi(arg + 8);
+      if (batchSize < 1 || batchSize > MAX_BATCH) {
+        printf("--batch must be between 1 and %d\n", MAX_BATCH);
+        exit(1);
+      }
+    } else if (!strncmp(arg, "--ring=", 7)) {
+      readbackRingSize = atoi(arg + 7);
+      if (readbackRingSize < 1 || readbackRingSize > MAX_READBACK_RING) {
+        printf("--ring must be between 1 and %d\n", MAX_READBACK_RING);
+        exit(1);
+      }
+    } else {
+      printf("Unknown argument: %s\n", arg);
+      printf("Usage: %s [--resolution=N] [--adaptive] [--density=N] [--passes=N]\n"
+             "          [--readback=sync|pbo] [--ring=N] [--batch=N] [--reduce=cpu|gpu]\n"
+             "          [--kernel=scalar|simd] [--layered] [--bench-kernel] [--bench-rays]\n"
+             "          [--projection=hemicube|hemisphere|tetrahedron] [--compare-projections]\n"
+             "          [--gather=render|form-factors|raycast|raster] [--rays=N]\n"
+             "          [--threads=N] [--accel=brute|grid] [--solver=gather|shoot|hierarchical]\n"
+             "          [--tolerance=X] [--residual=global|rect] [--extrapolate]\n"
+             "          [--update=jacobi|gauss-seidel] [--relax=W] [--sampling=full|adaptive]\n"
+             "          [--warm-start] [--schedule=D:N,...] [--skip-settled]\n"
+             "          [--output=DIR]\n", argv[0]);
+      exit(1);
+    }
+  }
+
+  // Cells fit the tallest projection, so they can be switched between.
+  hemicubeTextureWidth = hemicubeResolution;
+  hemicubeTextureHeight = hemicubeResolution * 3;
+
+  // The GPU reduction sizes its levels for one resolution.
+  if (adaptiveResolution && reduceMode == REDUCE_GPU) {
+    printf("--adaptive needs --reduce=cpu\n");
+    exit(1);
+  }
+
+  // Only the hemicube has GPU reduction, layered rendering and adaptive
+  // levels.
+  if ((projectionMode != PROJECTION_HEMICUBE || compareProjectionsOnly) &&
+      (reduceMode == REDUCE_GPU || adaptiveResolution)) {
+    printf("--projection and --compare-projections need --reduce=cpu and no --adaptive\n");
+    exit(1);
+  }
+  if (projectionMode != PROJECTION_HEMICUBE && hemicubeRenderMode == HEMICUBE_LAYERED) {
+    printf("--layered only works with --projection=hemicube\n");
+    exit(1);
+  }
+
+  // Texel ids are read back and weighted on the CPU at one resolution.
+  if ((gatherMode == GATHER_FORM_FACTORS || solverMode == SOLVER_SHOOT || warmStart) &&
+      (reduceMode == REDUCE_GPU || adaptiveResolution || hemicubeRenderMode == HEMICUBE_LAYERED || compareProjectionsOnly)) {
+    printf("--gather=form-factors, --solver=shoot and --warm-start need --reduce=cpu and no --adaptive, --layered or --compare-projections\n");
+    exit(1);
+  }
+  // Coarse levels render hemicubes for lightmaps that are resized under
+  // them; everything sized per texel at setup stays at --density.
+  if (scheduleLength > 0 &&
+      (gatherMode != GATHER_RENDER || solverMode != SOLVER_GATHER || adaptiveResolution ||
+       samplingMode == SAMPLING_ADAPTIVE || compareProjectionsOnly)) {
+    printf("--schedule only works with --gather=render and --solver=gather, without --adaptive, --sampling=adaptive or --compare-projections\n");
+    exit(1);
+  }
+  for (int level = 0; level < scheduleLength; level++) {
+    if (schedule[level].density >= texelDensity || (level > 0 && schedule[level].density <= schedule[level - 1].density)) {
+      printf("--schedule densities must go up, and stay below --density\n");
+      exit(1);
+    }
+    for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+      if ((int) (glm::min(glm::length(rects[i].da), glm::length(rects[i].db)) * schedule[level].density) < 1) {
+        printf("--schedule density %d leaves rect %d without texels\n", schedule[level].density, i);
+        exit(1);
+      }
+    }
+  }
+
+  // Adaptive sampling already decides which texels to render, and the
+  // other solvers don't gather texel by texel.
+  if (skipSettled && (solverMode != SOLVER_GATHER || samplingMode == SAMPLING_ADAPTIVE || scheduleLength > 0)) {
+    printf("--skip-settled only works with --solver=gather, without --sampling=adaptive or --schedule\n");
+    exit(1);
+  }
+  // Skipped texels count as unchanged, which understates the residual, and
+  // the change from pass to pass jumps on the passes that check them all,
+  // so neither converging nor extrapolating would see the real rate.
+  if (skipSettled && (tolerance > 0.0f || extrapolate)) {
+    printf("--skip-settled can't be used with --tolerance or --extrapolate\n");
+    exit(1);
+  }
+
+  if (warmStart && solverMode == SOLVER_SHOOT) {
+    printf("--solver=shoot starts from the emitters alone; drop --warm-start\n");
+    exit(1);
+  }
+  if (gatherMode != GATHER_RENDER && solverMode == SOLVER_SHOOT) {
+    printf("--solver=shoot renders its own hemicubes; drop --gather\n");
+    exit(1);
+  }
+
+  // A tolerance decides when to stop, so the default pass count would only
+  // cut it short.
+  if (tolerance > 0.0f && !passesGiven) {
+    passes = MAX_CONVERGE_PASSES;
+  }
+  if ((tolerance > 0.0f || extrapolate) && compareProjectionsOnly) {
+    printf("--compare-projections runs a fixed number of passes; drop --tolerance and --extrapolate\n");
+    exit(1);
+  }
+
+  // Shooting has its own measure of what is left, the unshot light, which
+  // the tolerance replaces SHOOT_THRESHOLD for.
+  if (solverMode == SOLVER_SHOOT && (residualMode == RESIDUAL_RECT || extrapolate)) {
+    printf("--solver=shoot only takes --tolerance, not --residual=rect or --extrapolate\n");
+    exit(1);
+  }
+
+  // Over-relaxing every texel at once overshoots where Gauss-Seidel's
+  // fresh neighbours would hold it back.
+  if (relaxation != 1.0f && updateMode != UPDATE_GAUSS_SEIDEL) {
+    printf("--relax needs --update=gauss-seidel\n");
+    exit(1);
+  }
+  if (updateMode == UPDATE_GAUSS_SEIDEL && solverMode == SOLVER_SHOOT) {
+    printf("--solver=shoot updates texels as it goes; drop --update=gauss-seidel\n");
+    exit(1);
+  }
+  // Form factors need a row for every texel, and the other gathers and
+  // solvers don't render a hemicube per texel to begin with.
+  if (samplingMode == SAMPLING_ADAPTIVE && (gatherMode != GATHER_RENDER || solverMode != SOLVER_GATHER)) {
+    printf("--sampling=adaptive only works with --gather=render and --solver=gather\n");
+    exit(1);
+  }
+  if (solverMode == SOLVER_HIERARCHICAL && (gatherMode != GATHER_RENDER || updateMode == UPDATE_GAUSS_SEIDEL)) {
+    printf("--solver=hierarchical gathers over its own links; drop --gather and --update=gauss-seidel\n");
+    exit(1);
+  }
+  if (gatherMode == GATHER_RAYCAST && adaptiveResolution) {
+    printf("--gather=raycast renders no hemicubes to pick resolutions for; drop --adaptive\n");
+    exit(1);
+  }
+  // The rasterizer only draws hemicubes, at one resolution.
+  if (gatherMode == GATHER_RASTER && (projectionMode != PROJECTION_HEMICUBE || adaptiveResolution)) {
+    printf("--gather=raster needs --projection=hemicube and no --adaptive\n");
+    exit(1);
+  }
+
+#if defined(HEADLESS)
+  if (!outputDirectory) {
+    outputDirectory = HEADLESS_OUTPUT_DIRECTORY;
+  }
+#endif
+
+  if (readbackMode == READBACK_SYNC) {
+    readbackRingSize = 1;
+  }
+
+  // Cells are three times taller than wide; lay them out so the atlas is
+  // roughly square.
+  batchColumns = (int) ceilf(sqrtf(batchSize * 3.0f));
+  if (batchColumns > batchSize) {
+    batchColumns = batchSize;
+  }
+  batchRows = (batchSize + batchColumns - 1) / batchColumns;
+}
+
 void tick() {
   {
     SDL_Event event;
@@ -317,6 +1086,7 @@ void tick() {
 }
 
 void setWindowSize() {
+#if !defined(HEADLESS)
   {
     int width;
     int height;
@@ -334,9 +1104,11 @@ void setWindowSize() {
 
     glViewport(0, 0, width, height);
   }
+#endif
 }
 
 void renderScene() {
+#if !defined(HEADLESS)
   {
     glm::mat4 cameraReorient = glm::lookAt(vec3(0.0f, 0.0f, 0.0f),
                                            vec3(0.0f, 1.0f, 0.0f),
@@ -350,6 +1122,7 @@ void renderScene() {
   }
 
   SDL_GL_SwapWindow(window);
+#endif
 }
 
 void render(glm::mat4 camera, GLuint program) {
@@ -364,9 +1137,13 @@ void render(glm::mat4 camera, GLuint program) {
   GLint cameraLoc = glGetUniformLocation(program, "camera");
   glUniformMatrix4fv(cameraLoc, 1, GL_FALSE, glm::value_ptr(camera));
 
+  // Only the item shader has it; setting -1 is ignored.
+  GLint rectLoc = glGetUniformLocation(program, "rect");
+
   glBindVertexArray(vao);
   for (int i = 0; i < ARRAY_LENGTH(quads); i++) {
     glBindTexture(GL_TEXTURE_2D, textures[i]);
+    glUniform1i(rectLoc, i);
     glDrawArrays(GL_TRIANGLES, 6 * i, 6);
   }
   glBindVertexArray(0);
@@ -374,348 +1151,2442 @@ void render(glm::mat4 camera, GLuint program) {
   glUseProgram(0);
 }
 
-GLuint hemicubeFrameBuffer;
-GLuint hemicubeColorBuffer;
-GLuint hemicubeDepthBuffer;
+// render() over the tessellated mesh.
+void renderTessellated(glm::mat4 camera, GLuint program) {
+  glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+  glClearDepth(1.0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  glUseProgram(program);
+  GLint texLoc = glGetUniformLocation(program, "tex");
+  glUniform1i(texLoc, 0);
+
+  GLint cameraLoc = glGetUniformLocation(program, "camera");
+  glUniformMatrix4fv(cameraLoc, 1, GL_FALSE, glm::value_ptr(camera));
+
+  GLint rectLoc = glGetUniformLocation(program, "rect");
+
+  glBindVertexArray(hemisphereVao);
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+    glUniform1i(rectLoc, i);
+    glDrawArrays(GL_TRIANGLES, tessellatedFirst[i], tessellatedCount[i]);
+  }
+  glBindVertexArray(0);
+
+  glUseProgram(0);
+}
 
 void hemicubeSetup() {
-  glGenFramebuffers(1, &hemicubeFrameBuffer);
+  int atlasWidth = hemicubeTextureWidth * batchColumns;
+  int atlasHeight = hemicubeTextureHeight * batchRows;
 
-  glBindFramebuffer(GL_FRAMEBUFFER, hemicubeFrameBuffer);
+  hemicubeTextureData = (Color*)
+    malloc(sizeof(Color) * hemicubeTextureWidth * hemicubeTextureHeight * batchSize);
 
-  glGenTextures(1, &hemicubeColorBuffer);
-  glBindTexture(GL_TEXTURE_2D, hemicubeColorBuffer);
+  for (int i = 0; i < readbackRingSize; i++) {
+    HemicubeSlot* slot = &hemicubeSlots[i];
 
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, HEMICUBE_TEXTURE_WIDTH, HEMICUBE_TEXTURE_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glGenFramebuffers(1, &slot->frameBuffer);
 
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, slot->frameBuffer);
 
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hemicubeColorBuffer, 0);
-  glBindTexture(GL_TEXTURE_2D, 0);
+    glGenTextures(1, &slot->colorBuffer);
+    glBindTexture(GL_TEXTURE_2D, slot->colorBuffer);
 
-  glGenRenderbuffers(1, &hemicubeDepthBuffer);
-  glBindRenderbuffer(GL_RENDERBUFFER, hemicubeDepthBuffer);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, HEMICUBE_TEXTURE_WIDTH, HEMICUBE_TEXTURE_HEIGHT);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, atlasWidth, atlasHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 
-  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, hemicubeDepthBuffer);
-  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
-}
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, slot->colorBuffer, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
 
-void renderHemicube(vec3 location, vec3 normal) {
-  GLuint program = programs[1];
+    glGenRenderbuffers(1, &slot->depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, slot->depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, atlasWidth, atlasHeight);
 
-  glBindFramebuffer(GL_FRAMEBUFFER, hemicubeFrameBuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, slot->depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
-  float nearPlane = 0.05f;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-  assert(nearPlane < 0.5f / TEXEL_DENSITY);
+    if (readbackMode == READBACK_PBO) {
+      glGenBuffers(1, &slot->pixelBuffer);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pixelBuffer);
+      glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(Color) * hemicubeTextureWidth * hemicubeTextureHeight * batchSize, NULL, GL_STREAM_READ);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
 
-  {
-    glUseProgram(program);
-    GLint projLoc = glGetUniformLocation(program, "proj");
-    glm::mat4 proj = glm::perspective((float) M_PI_2, 1.0f, nearPlane, 100.0f);
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(proj));
-    glUseProgram(0);
+    slot->pending = false;
+    slot->sampleCount = 0;
   }
+}
 
-  vec3 up;
-  if (glm::angle(normal, vec3(0.0f, 0.0f, 1.0f)) > 0.1 && glm::angle(normal, vec3(0.0f, 0.0f, -1.0f)) > 0.1) {
-    up = vec3(0.0f, 0.0f, 1.0f);
-  } else {
-    up = vec3(1.0f, 0.0f, 0.0f);
-  }
+int cellX(int cell) {
+  return (cell % batchColumns) * hemicubeTextureWidth;
+}
 
-  vec3 sideways = glm::cross(normal, up);
+int cellY(int cell) {
+  return (cell / batchColumns) * hemicubeTextureHeight;
+}
 
-  // Front
-  {
-    glViewport(FRONT_X, FRONT_Y, HEMICUBE_RESOLUTION, HEMICUBE_RESOLUTION);
-    glm::mat4 camera = glm::lookAt(location, location + normal, up);
-    render(camera, program);
-  }
+GLuint layeredFrameBuffer;
+GLuint layeredColorBuffer;
+GLuint layeredDepthBuffer;
+GLuint layerFrameBuffers[HEMICUBE_FACES];
+
+// All five faces are drawn in one submission: the geometry shader copies
+// each triangle into a layer per face. The faces are then blitted into the
+// usual hemicube layout so readback and reduction don't need to know.
+void layeredSetup() {
+  const int R = hemicubeResolution;
 
+  layeredProgram = glCreateProgram();
   {
-    glEnable(GL_SCISSOR_TEST);
+    GLuint layeredVert = createShader("shaders/radiosity_layered.vert.glsl", GL_VERTEX_SHADER);
+    GLuint layeredGeom = createShader("shaders/radiosity_layered.geom.glsl", GL_GEOMETRY_SHADER);
+    GLuint layeredFrag = createShader("shaders/radiosity.frag.glsl", GL_FRAGMENT_SHADER);
 
-    // Right
-    {
-      glViewport(RIGHT_X, RIGHT_Y, HEMICUBE_RESOLUTION, HEMICUBE_RESOLUTION);
-      glScissor(RIGHT_X, RIGHT_Y, HEMICUBE_RESOLUTION/2, HEMICUBE_RESOLUTION);
-      glm::mat4 camera = glm::lookAt(location, location + sideways, up);
-      render(camera, program);
-    }
+    glAttachShader(layeredProgram, layeredVert);
+    glAttachShader(layeredProgram, layeredGeom);
+    glAttachShader(layeredProgram, layeredFrag);
 
-    // Left
-    {
-      glScissor(LEFT_X, LEFT_Y, HEMICUBE_RESOLUTION/2, HEMICUBE_RESOLUTION);
-      glViewport(LEFT_X - HEMICUBE_RESOLUTION/2, LEFT_Y, HEMICUBE_RESOLUTION, HEMICUBE_RESOLUTION);
-      glm::mat4 camera = glm::lookAt(location, location - sideways, up);
-      render(camera, program);
-    }
+    glBindAttribLocation(layeredProgram, POSITION_ATTRIB, "position");
+    glBindAttribLocation(layeredProgram, TEXCOORD_ATTRIB, "texcoord");
 
-    // Down
-    {
-      glViewport(TOP_X, TOP_Y - HEMICUBE_RESOLUTION/2, HEMICUBE_RESOLUTION, HEMICUBE_RESOLUTION);
-      glScissor(TOP_X, TOP_Y, HEMICUBE_RESOLUTION, HEMICUBE_RESOLUTION/2);
-      glm::mat4 camera = glm::lookAt(location, location - up, normal);
-      render(camera, program);
-    }
+    glLinkProgram(layeredProgram);
 
-    // Up
-    {
-      glViewport(BOTTOM_X, BOTTOM_Y, HEMICUBE_RESOLUTION, HEMICUBE_RESOLUTION);
-      glScissor(BOTTOM_X, BOTTOM_Y, HEMICUBE_RESOLUTION, HEMICUBE_RESOLUTION/2);
-      glm::mat4 camera = glm::lookAt(location, location + up, -normal);
-      render(camera, program);
-    }
+    glDeleteShader(layeredVert);
+    glDeleteShader(layeredGeom);
+    glDeleteShader(layeredFrag);
+  }
 
-    glDisable(GL_SCISSOR_TEST);
+  glGenTextures(1, &layeredColorBuffer);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, layeredColorBuffer);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB16F, R, R, HEMICUBE_FACES, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glGenTextures(1, &layeredDepthBuffer);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, layeredDepthBuffer);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT16, R, R, HEMICUBE_FACES, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, NULL);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  glGenFramebuffers(1, &layeredFrameBuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, layeredFrameBuffer);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, layeredColorBuffer, 0);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, layeredDepthBuffer, 0);
+
+  glGenFramebuffers(HEMICUBE_FACES, layerFrameBuffers);
+  for (int i = 0; i < HEMICUBE_FACES; i++) {
+    glBindFramebuffer(GL_FRAMEBUFFER, layerFrameBuffers[i]);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, layeredColorBuffer, 0, i);
   }
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-Color hemicubeTextureData[HEMICUBE_TEXTURE_HEIGHT][HEMICUBE_TEXTURE_WIDTH];
-float multiplierMap[HEMICUBE_TEXTURE_HEIGHT][HEMICUBE_TEXTURE_WIDTH];
+void hemisphereSetup() {
+  hemisphereProgram = glCreateProgram();
+  {
+    GLuint hemisphereVert = createShader("shaders/radiosity_hemisphere.vert.glsl", GL_VERTEX_SHADER);
+    GLuint hemisphereFrag = createShader("shaders/radiosity.frag.glsl", GL_FRAGMENT_SHADER);
 
-float cosine(vec3 a, vec3 b) {
-  return glm::dot(a, b) / glm::length(a) / glm::length(b);
-}
+    glAttachShader(hemisphereProgram, hemisphereVert);
+    glAttachShader(hemisphereProgram, hemisphereFrag);
 
-void prepareMultiplierMap() {
-  vec3 surfaceNormal = vec3(0.0, HEMICUBE_RESOLUTION/2, 0.0f);
+    glBindAttribLocation(hemisphereProgram, POSITION_ATTRIB, "position");
+    glBindAttribLocation(hemisphereProgram, TEXCOORD_ATTRIB, "texcoord");
 
-  vec3 faceNormal = vec3(0.0f, 0.0f, HEMICUBE_RESOLUTION/2);
-  for (int y = TOP_Y; y < TOP_Y + HEMICUBE_RESOLUTION/2; y++) {
-    for (int x = TOP_X; x < TOP_X + HEMICUBE_RESOLUTION; x++) {
-      vec3 loc = vec3(TOP_X + HEMICUBE_RESOLUTION/2 - x, y - TOP_Y, HEMICUBE_RESOLUTION/2);
-      multiplierMap[y][x] = cosine(faceNormal, loc) * cosine(surfaceNormal, loc);
-    }
-  }
+    glLinkProgram(hemisphereProgram);
 
-  faceNormal = vec3(0.0f, 0.0f, -HEMICUBE_RESOLUTION/2);
-  for (int y = BOTTOM_Y; y < BOTTOM_Y + HEMICUBE_RESOLUTION/2; y++) {
-    for (int x = BOTTOM_X; x < BOTTOM_X + HEMICUBE_RESOLUTION; x++) {
-      vec3 loc = vec3(BOTTOM_X + HEMICUBE_RESOLUTION/2 - x, BOTTOM_Y + HEMICUBE_RESOLUTION/2 - y, -HEMICUBE_RESOLUTION/2);
-      multiplierMap[y][x] = cosine(faceNormal, loc) * cosine(surfaceNormal, loc);
-    }
+    glDeleteShader(hemisphereVert);
+    glDeleteShader(hemisphereFrag);
   }
 
-  faceNormal = vec3(-HEMICUBE_RESOLUTION/2, 0.0f, 0.0f);
-  for (int y = LEFT_Y; y < LEFT_Y + HEMICUBE_RESOLUTION; y++) {
-    for (int x = LEFT_X; x < LEFT_X + HEMICUBE_RESOLUTION/2; x++) {
-      vec3 loc = vec3(-HEMICUBE_RESOLUTION/2, x - LEFT_X, LEFT_Y + HEMICUBE_RESOLUTION/2 - y);
-      multiplierMap[y][x] = cosine(faceNormal, loc) * cosine(surfaceNormal, loc);
-    }
-  }
+  glUseProgram(hemisphereProgram);
+  glUniform1f(glGetUniformLocation(hemisphereProgram, "near"), HEMICUBE_NEAR);
+  glUniform1f(glGetUniformLocation(hemisphereProgram, "far"), HEMICUBE_FAR);
+  glUseProgram(0);
 
-  faceNormal = vec3(HEMICUBE_RESOLUTION/2, 0.0f, 0.0f);
-  for (int y = RIGHT_Y; y < RIGHT_Y + HEMICUBE_RESOLUTION; y++) {
-    for (int x = RIGHT_X; x < RIGHT_X + HEMICUBE_RESOLUTION/2; x++) {
-      vec3 loc = vec3(HEMICUBE_RESOLUTION/2, RIGHT_X + HEMICUBE_RESOLUTION/2 - x, RIGHT_Y + HEMICUBE_RESOLUTION/2 - y);
-      multiplierMap[y][x] = cosine(faceNormal, loc) * cosine(surfaceNormal, loc);
-    }
-  }
+  buildTessellatedMesh(HEMISPHERE_CELL_SIZE);
 
-  faceNormal = vec3(0.0f, HEMICUBE_RESOLUTION/2, 0.0f);
-  for (int y = FRONT_Y; y < FRONT_Y + HEMICUBE_RESOLUTION; y++) {
-    for (int x = FRONT_X; x < FRONT_X + HEMICUBE_RESOLUTION; x++) {
-      vec3 loc = vec3(FRONT_X + HEMICUBE_RESOLUTION/2 - x, HEMICUBE_RESOLUTION/2, FRONT_Y + HEMICUBE_RESOLUTION/2 - y);
-      multiplierMap[y][x] = cosine(faceNormal, loc) * cosine(surfaceNormal, loc);
-    }
-  }
+  glGenBuffers(1, &hemisphereVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, hemisphereVbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * tessellatedVertexCount, tessellatedVertices, GL_STATIC_DRAW);
 
-  float total = 0.0f;
-  for (int y = 0; y < HEMICUBE_TEXTURE_HEIGHT; y++) {
-    for (int x = 0; x < HEMICUBE_TEXTURE_WIDTH; x++) {
-      total += multiplierMap[y][x];
-    }
-  }
-  for (int y = 0; y < HEMICUBE_TEXTURE_HEIGHT; y++) {
-    for (int x = 0; x < HEMICUBE_TEXTURE_WIDTH; x++) {
-      multiplierMap[y][x] /= total;
-    }
-  }
+  glGenVertexArrays(1, &hemisphereVao);
+  glBindVertexArray(hemisphereVao);
 
-#if 0
-  GLuint multiplierMapTexture;
-  glGenTextures(1, &multiplierMapTexture);
+  glEnableVertexAttribArray(POSITION_ATTRIB);
+  glVertexAttribPointer(POSITION_ATTRIB, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
 
-  glBindTexture(GL_TEXTURE_2D, multiplierMapTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, HEMICUBE_TEXTURE_WIDTH, HEMICUBE_TEXTURE_HEIGHT, 0, GL_RED, GL_FLOAT, multiplierMap);
-  glBindTexture(GL_TEXTURE_2D, 0);
-#endif
-}
+  glEnableVertexAttribArray(TEXCOORD_ATTRIB);
+  glVertexAttribPointer(TEXCOORD_ATTRIB, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) (9 * sizeof(float)));
 
-Color hemicubeAverage() {
-  glBindFramebuffer(GL_FRAMEBUFFER, hemicubeFrameBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindVertexArray(0);
 
-  glReadPixels(0, 0,
-               HEMICUBE_TEXTURE_WIDTH, HEMICUBE_TEXTURE_HEIGHT,
-               GL_RGB, GL_FLOAT,
-               hemicubeTextureData);
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  printf("Hemisphere mesh: %d triangles\n", tessellatedVertexCount / 3);
+}
 
-  Color result = {0.0f, 0.0f, 0.0f};
+void blitFace(int face, int srcX, int srcY, int dstX, int dstY, int width, int height) {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, layerFrameBuffers[face]);
+  glBlitFramebuffer(srcX, srcY, srcX + width, srcY + height,
+                    dstX, dstY, dstX + width, dstY + height,
+                    GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
 
-  for (int y = TOP_Y; y < TOP_Y + HEMICUBE_RESOLUTION/2; y++) {
-    for (int x = TOP_X; x < TOP_X + HEMICUBE_RESOLUTION; x++) {
-      result += hemicubeTextureData[y][x] * multiplierMap[y][x];
-    }
+void renderHemicubeLayered(GLuint frameBuffer, int originX, int originY, int resolution, glm::mat4 proj, glm::mat4 cameras[HEMICUBE_FACES]) {
+  glm::mat4 faces[HEMICUBE_FACES];
+  for (int i = 0; i < HEMICUBE_FACES; i++) {
+    faces[i] = proj * cameras[i];
   }
 
-  for (int y = BOTTOM_Y; y < BOTTOM_Y + HEMICUBE_RESOLUTION/2; y++) {
-    for (int x = BOTTOM_X; x < BOTTOM_X + HEMICUBE_RESOLUTION; x++) {
-      result += hemicubeTextureData[y][x] * multiplierMap[y][x];
-    }
-  }
+  glUseProgram(layeredProgram);
+  GLint facesLoc = glGetUniformLocation(layeredProgram, "faces");
+  glUniformMatrix4fv(facesLoc, HEMICUBE_FACES, GL_FALSE, glm::value_ptr(faces[0]));
+  glUseProgram(0);
 
-  for (int y = LEFT_Y; y < LEFT_Y + HEMICUBE_RESOLUTION; y++) {
-    for (int x = LEFT_X; x < LEFT_X + HEMICUBE_RESOLUTION/2; x++) {
-      result += hemicubeTextureData[y][x] * multiplierMap[y][x];
-    }
-  }
+  const int R = resolution;
 
-  for (int y = RIGHT_Y; y < RIGHT_Y + HEMICUBE_RESOLUTION; y++) {
-    for (int x = RIGHT_X; x < RIGHT_X + HEMICUBE_RESOLUTION/2; x++) {
-      result += hemicubeTextureData[y][x] * multiplierMap[y][x];
-    }
-  }
+  glBindFramebuffer(GL_FRAMEBUFFER, layeredFrameBuffer);
+  glViewport(0, 0, R, R);
+  render(glm::mat4(1.0f), layeredProgram);
 
-  for (int y = FRONT_Y; y < FRONT_Y + HEMICUBE_RESOLUTION; y++) {
-    for (int x = FRONT_X; x < FRONT_X + HEMICUBE_RESOLUTION; x++) {
-      result += hemicubeTextureData[y][x] * multiplierMap[y][x];
-    }
-  }
+  // Same halves the scissors keep in the multipass path.
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, frameBuffer);
+  blitFace(0, 0, 0, originX + FRONT_X(R), originY + FRONT_Y(R), R, R);
+  blitFace(1, 0, 0, originX + RIGHT_X(R), originY + RIGHT_Y(R), R/2, R);
+  blitFace(2, R/2, 0, originX + LEFT_X(R), originY + LEFT_Y(R), R/2, R);
+  blitFace(3, 0, R/2, originX + TOP_X(R), originY + TOP_Y(R), R, R/2);
+  blitFace(4, 0, 0, originX + BOTTOM_X(R), originY + BOTTOM_Y(R), R, R/2);
 
-  return result;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-GLuint createShader(const char* filename, GLenum shaderType) {
-  FILE* file = fopen(filename, "r");
-
+void setProjection(GLuint program, glm::mat4 proj) {
+  glUseProgram(program);
+  GLint projLoc = glGetUniformLocation(program, "proj");
+  glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(proj));
+  glUseProgram(0);
+}
+
+// Any direction at right angles to the normal will do; this one keeps
+// walls upright.
+vec3 upFor(vec3 normal) {
+  if (glm::angle(normal, vec3(0.0f, 0.0f, 1.0f)) > 0.1 && glm::angle(normal, vec3(0.0f, 0.0f, -1.0f)) > 0.1) {
+    return vec3(0.0f, 0.0f, 1.0f);
+  } else {
+    return vec3(1.0f, 0.0f, 0.0f);
+  }
+}
+
+void renderHemicube(GLuint frameBuffer, int originX, int originY, vec3 location, vec3 normal, int resolution) {
+  GLuint program = renderItems ? itemProgram : programs[1];
+  const int R = resolution;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+
+  float nearPlane = HEMICUBE_NEAR;
+
+  assert(nearPlane < 0.5f / texelDensity);
+
+  vec3 up = upFor(normal);
+  vec3 sideways = glm::cross(normal, up);
+
+  if (hemicubeRenderMode == HEMICUBE_LAYERED) {
+    glm::mat4 proj = glm::perspective((float) M_PI_2, 1.0f, nearPlane, HEMICUBE_FAR);
+    glm::mat4 cameras[HEMICUBE_FACES] = {
+      glm::lookAt(location, location + normal, up),
+      glm::lookAt(location, location + sideways, up),
+      glm::lookAt(location, location - sideways, up),
+      glm::lookAt(location, location - up, normal),
+      glm::lookAt(location, location + up, -normal)
+    };
+    renderHemicubeLayered(frameBuffer, originX, originY, R, proj, cameras);
+    return;
+  }
+
+  // The side faces only keep the half above the surface, so they get a
+  // frustum of just that half and a viewport to match. Every face is still
+  // scissored, as render()'s clear ignores the viewport and the rest of
+  // the atlas may hold other hemicubes of the batch.
+  glEnable(GL_SCISSOR_TEST);
+
+  float n = nearPlane;
+
+  // Front
+  {
+    glViewport(originX + FRONT_X(R), originY + FRONT_Y(R), R, R);
+    glScissor(originX + FRONT_X(R), originY + FRONT_Y(R), R, R);
+    setProjection(program, glm::frustum(-n, n, -n, n, n, HEMICUBE_FAR));
+    glm::mat4 camera = glm::lookAt(location, location + normal, up);
+    render(camera, program);
+  }
+
+  // Right, whose left half is above the surface
+  {
+    glViewport(originX + RIGHT_X(R), originY + RIGHT_Y(R), R/2, R);
+    glScissor(originX + RIGHT_X(R), originY + RIGHT_Y(R), R/2, R);
+    setProjection(program, glm::frustum(-n, 0.0f, -n, n, n, HEMICUBE_FAR));
+    glm::mat4 camera = glm::lookAt(location, location + sideways, up);
+    render(camera, program);
+  }
+
+  // Left, right half
+  {
+    glViewport(originX + LEFT_X(R), originY + LEFT_Y(R), R/2, R);
+    glScissor(originX + LEFT_X(R), originY + LEFT_Y(R), R/2, R);
+    setProjection(program, glm::frustum(0.0f, n, -n, n, n, HEMICUBE_FAR));
+    glm::mat4 camera = glm::lookAt(location, location - sideways, up);
+    render(camera, program);
+  }
+
+  // Down, top half
+  {
+    glViewport(originX + TOP_X(R), originY + TOP_Y(R), R, R/2);
+    glScissor(originX + TOP_X(R), originY + TOP_Y(R), R, R/2);
+    setProjection(program, glm::frustum(-n, n, 0.0f, n, n, HEMICUBE_FAR));
+    glm::mat4 camera = glm::lookAt(location, location - up, normal);
+    render(camera, program);
+  }
+
+  // Up, bottom half
+  {
+    glViewport(originX + BOTTOM_X(R), originY + BOTTOM_Y(R), R, R/2);
+    glScissor(originX + BOTTOM_X(R), originY + BOTTOM_Y(R), R, R/2);
+    setProjection(program, glm::frustum(-n, n, -n, 0.0f, n, HEMICUBE_FAR));
+    glm::mat4 camera = glm::lookAt(location, location + up, -normal);
+    render(camera, program);
+  }
+
+  glDisable(GL_SCISSOR_TEST);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// One R x R render; the vertex shader does the projection and clips what is
+// behind the surface.
+void renderHemisphere(GLuint frameBuffer, int originX, int originY, vec3 location, vec3 normal, int resolution) {
+  const int R = resolution;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+  glEnable(GL_SCISSOR_TEST);
+  glEnable(GL_CLIP_DISTANCE0);
+
+  glViewport(originX, originY, R, R);
+  glScissor(originX, originY, R, R);
+  glm::mat4 camera = glm::lookAt(location, location + normal, upFor(normal));
+  renderTessellated(camera, renderItems ? hemisphereItemProgram : hemisphereProgram);
+
+  glDisable(GL_CLIP_DISTANCE0);
+  glDisable(GL_SCISSOR_TEST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// The three faces of a cube standing on its corner over the surface, each
+// R x R and stacked like the hemicube's bands. Seen from the center each
+// face spans [-2, 1] in both directions, with the horizon the diagonal
+// x + y = -1, so only half of each face is above the surface.
+void renderTetrahedron(GLuint frameBuffer, int originX, int originY, vec3 location, vec3 normal, int resolution) {
+  GLuint program = renderItems ? itemProgram : programs[1];
+  const int R = resolution;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+
+  float n = HEMICUBE_NEAR;
+  setProjection(program, glm::frustum(-2.0f * n, n, -2.0f * n, n, n, HEMICUBE_FAR));
+
+  // The cube's axes, a third of the way round from each other and all at
+  // the same angle to the normal, in right handed order.
+  vec3 up = upFor(normal);
+  vec3 sideways = glm::cross(normal, up);
+  vec3 axes[3];
+  for (int k = 0; k < 3; k++) {
+    float phi = 2.0f * (float) M_PI * k / 3.0f;
+    axes[k] = normal / sqrtf(3.0f) + sqrtf(2.0f / 3.0f) * (up * cosf(phi) + sideways * sinf(phi));
+  }
+  if (glm::dot(glm::cross(axes[0], axes[1]), axes[2]) < 0.0f) {
+    vec3 axis = axes[1];
+    axes[1] = axes[2];
+    axes[2] = axis;
+  }
+
+  glEnable(GL_SCISSOR_TEST);
+
+  for (int k = 0; k < 3; k++) {
+    glViewport(originX, originY + k*R, R, R);
+    glScissor(originX, originY + k*R, R, R);
+    glm::mat4 camera = glm::lookAt(location, location + axes[k], axes[(k + 1) % 3]);
+    render(camera, program);
+  }
+
+  glDisable(GL_SCISSOR_TEST);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void renderProjection(GLuint frameBuffer, int originX, int originY, vec3 location, vec3 normal, int resolution) {
+  switch (projectionMode) {
+  case PROJECTION_HEMICUBE:
+    renderHemicube(frameBuffer, originX, originY, location, normal, resolution);
+    break;
+  case PROJECTION_HEMISPHERE:
+    renderHemisphere(frameBuffer, originX, originY, location, normal, resolution);
+    break;
+  case PROJECTION_TETRAHEDRON:
+    renderTetrahedron(frameBuffer, originX, originY, location, normal, resolution);
+    break;
+  }
+}
+
+// Rows a projection of the given resolution fills in its cell.
+int projectionHeight(int resolution) {
+  return projectionMode == PROJECTION_HEMISPHERE ? resolution : resolution * 3;
+}
+
+// The hemicube layout is three R x R bands: top over bottom, left beside
+// right, and the front face. Sampled at pixel centers each band mirrors
+// across both of its center lines, so only one quadrant of weights is kept
+// per band: R/2 x R/2 floats at row band * R/2, indexed by distance from
+// the center lines. This is the full resolution map; adaptive mode keeps
+// one per level.
+//
+// The weights are delta form factors: both cosines over the squared
+// distance to the pixel, so each projection estimates the same integral.
+float* multiplierMap;
+
+#define MULTIPLIER_BANDS 3
+
+float cosine(vec3 a, vec3 b) {
+  return glm::dot(a, b) / glm::length(a) / glm::length(b);
+}
+
+float formFactor(vec3 faceNormal, vec3 surfaceNormal, vec3 loc) {
+  return cosine(faceNormal, loc) * cosine(surfaceNormal, loc) / glm::length2(loc);
+}
+
+void fillMultiplierMap(float* multiplierMap, int resolution) {
+  const int R = resolution;
+  const int H = R/2;
+
+  vec3 surfaceNormal = vec3(0.0, H, 0.0f);
+
+  for (int qy = 0; qy < H; qy++) {
+    for (int qx = 0; qx < H; qx++) {
+      float across = qx + 0.5f;
+      float along = qy + 0.5f;
+
+      // Top and bottom: rows nearest the band's middle look highest.
+      vec3 faceNormal = vec3(0.0f, 0.0f, H);
+      vec3 loc = vec3(across, H - along, H);
+      multiplierMap[(0*H + qy) * H + qx] = formFactor(faceNormal, surfaceNormal, loc);
+
+      // Left and right: the same, turned on its side.
+      faceNormal = vec3(H, 0.0f, 0.0f);
+      loc = vec3(H, H - across, along);
+      multiplierMap[(1*H + qy) * H + qx] = formFactor(faceNormal, surfaceNormal, loc);
+
+      faceNormal = vec3(0.0f, H, 0.0f);
+      loc = vec3(across, H, along);
+      multiplierMap[(2*H + qy) * H + qx] = formFactor(faceNormal, surfaceNormal, loc);
+    }
+  }
+
+  // Each stored weight stands for four pixels.
+  float total = 0.0f;
+  for (int i = 0; i < MULTIPLIER_BANDS * H*H; i++) {
+    total += 4 * multiplierMap[i];
+  }
+  for (int i = 0; i < MULTIPLIER_BANDS * H*H; i++) {
+    multiplierMap[i] /= total;
+  }
+}
+
+// The hemisphere's image is the base of the hemisphere, where equal areas
+// are equal form factors, so every pixel whose center is on the disk gets
+// the same weight. One quadrant, like a single hemicube band.
+void fillHemisphereMap(float* multiplierMap, int resolution) {
+  const int H = resolution/2;
+
+  int inside = 0;
+  for (int qy = 0; qy < H; qy++) {
+    for (int qx = 0; qx < H; qx++) {
+      float x = (qx + 0.5f) / H;
+      float y = (qy + 0.5f) / H;
+      multiplierMap[qy * H + qx] = x*x + y*y <= 1.0f;
+      inside += x*x + y*y <= 1.0f;
+    }
+  }
+
+  for (int i = 0; i < H*H; i++) {
+    multiplierMap[i] /= 4 * inside;
+  }
+}
+
+// One R x R map shared by the tetrahedron's three faces. A face pixel at
+// (x, y) on the plane at distance 1 looks along (x, y, 1), which is at
+// cosine (1 + x + y) / sqrt(3) to the surface normal; below the horizon
+// the weight is zero.
+void fillTetrahedronMap(float* multiplierMap, int resolution) {
+  const int R = resolution;
+
+  float total = 0.0f;
+  for (int j = 0; j < R; j++) {
+    for (int i = 0; i < R; i++) {
+      float x = -2.0f + 3.0f * (i + 0.5f) / R;
+      float y = -2.0f + 3.0f * (j + 0.5f) / R;
+      float r2 = 1.0f + x*x + y*y;
+      float weight = glm::max(0.0f, 1.0f + x + y) / (r2 * r2);
+      multiplierMap[j * R + i] = weight;
+      total += 3 * weight;
+    }
+  }
+
+  for (int i = 0; i < R*R; i++) {
+    multiplierMap[i] /= total;
+  }
+}
+
+// The kernels below are instantiated for the common resolutions so their
+// loop bounds fold to constants. FIXED_R = 0 is the generic fallback, which
+// reads the resolution at runtime instead. With BANDS = 1 they cover the
+// hemisphere's disk.
+
+template <int FIXED_R, int BANDS = MULTIPLIER_BANDS>
+Color hemicubeAverageScalar(Color* data, const float* multiplierMap, int resolution) {
+  const int R = FIXED_R ? FIXED_R : resolution;
+  const int H = R/2;
+
+  Color result = {0.0f, 0.0f, 0.0f};
+
+  for (int band = 0; band < BANDS; band++) {
+    for (int qy = 0; qy < H; qy++) {
+      // The rows qy either side of the band's middle, from their middle.
+      Color* above = data + (band*R + H + qy) * R + H;
+      Color* below = data + (band*R + H - 1 - qy) * R + H;
+      const float* weights = multiplierMap + (band*H + qy) * H;
+
+      for (int qx = 0; qx < H; qx++) {
+        Color sum = above[qx] + above[-1 - qx] + below[qx] + below[-1 - qx];
+        result += sum * weights[qx];
+      }
+    }
+  }
+
+  return result;
+}
+
+template <int FIXED_R, int BANDS = MULTIPLIER_BANDS>
+Color hemicubeAverageSimd(Color* data, const float* multiplierMap, int resolution) {
+  return foldedWeightedSum<FIXED_R, BANDS>(data, multiplierMap, resolution);
+}
+
+Color tetrahedronAverageScalar(Color* data, const float* multiplierMap, int resolution) {
+  const int R = resolution;
+
+  Color result = {0.0f, 0.0f, 0.0f};
+  for (int face = 0; face < 3; face++) {
+    for (int i = 0; i < R*R; i++) {
+      result += data[face*R*R + i] * multiplierMap[i];
+    }
+  }
+
+  return result;
+}
+
+Color tetrahedronAverageSimd(Color* data, const float* multiplierMap, int resolution) {
+  const int R = resolution;
+
+  Color result = {0.0f, 0.0f, 0.0f};
+  for (int face = 0; face < 3; face++) {
+    result += weightedPixelSum(data + face*R*R, multiplierMap, R*R);
+  }
+
+  return result;
+}
+
+typedef Color (*HemicubeKernel)(Color* data, const float* multiplierMap, int resolution);
+
+struct HemicubeLevel {
+  int resolution;
+  float* multiplierMap;
+  HemicubeKernel scalarKernel;
+  HemicubeKernel simdKernel;
+};
+
+HemicubeLevel hemicubeLevels[MAX_HEMICUBE_LEVELS];
+int hemicubeLevelCount;
+
+HemicubeLevel probeLevel;
+
+template <int FIXED_R>
+void useResolution(HemicubeLevel* level) {
+  level->scalarKernel = hemicubeAverageScalar<FIXED_R>;
+  level->simdKernel = hemicubeAverageSimd<FIXED_R>;
+}
+
+// Levels are prepared again when compareProjections() switches projection.
+void prepareLevel(HemicubeLevel* level, int resolution) {
+  const int H = resolution/2;
+
+  level->resolution = resolution;
+  free(level->multiplierMap);
+
+  switch (projectionMode) {
+  case PROJECTION_HEMICUBE:
+    level->multiplierMap = (float*) malloc(sizeof(float) * MULTIPLIER_BANDS * H*H);
+    fillMultiplierMap(level->multiplierMap, resolution);
+
+    switch (resolution) {
+    case 32: useResolution<32>(level); break;
+    case 50: useResolution<50>(level); break;
+    case 64: useResolution<64>(level); break;
+    case 128: useResolution<128>(level); break;
+    case 256: useResolution<256>(level); break;
+    default: useResolution<0>(level); break;
+    }
+    break;
+  case PROJECTION_HEMISPHERE:
+    level->multiplierMap = (float*) malloc(sizeof(float) * H*H);
+    fillHemisphereMap(level->multiplierMap, resolution);
+    level->scalarKernel = hemicubeAverageScalar<0, 1>;
+    level->simdKernel = hemicubeAverageSimd<0, 1>;
+    break;
+  case PROJECTION_TETRAHEDRON:
+    level->multiplierMap = (float*) malloc(sizeof(float) * resolution * resolution);
+    fillTetrahedronMap(level->multiplierMap, resolution);
+    level->scalarKernel = tetrahedronAverageScalar;
+    level->simdKernel = tetrahedronAverageSimd;
+    break;
+  }
+}
+
+void prepareMultiplierMap() {
+  hemicubeLevelCount = adaptiveResolution ? MAX_HEMICUBE_LEVELS : 1;
+
+  int resolution = hemicubeResolution;
+  for (int i = 0; i < hemicubeLevelCount; i++) {
+    prepareLevel(&hemicubeLevels[i], resolution);
+    // Halved, but kept even.
+    resolution = glm::max(2, resolution / 4 * 2);
+  }
+
+  multiplierMap = hemicubeLevels[0].multiplierMap;
+
+  if (adaptiveResolution) {
+    prepareLevel(&probeLevel, PROBE_RESOLUTION);
+  }
+}
+
+struct ReduceLevel {
+  GLuint frameBuffer;
+  GLuint texture;
+  int width;
+  int height;
+};
+
+ReduceLevel reduceLevels[MAX_REDUCE_LEVELS];
+int reduceLevelCount = 0;
+
+GLuint multiplierMapTexture;
+
+// Each level sums REDUCE_BLOCK x REDUCE_BLOCK texels of the previous one,
+// 50x150 -> 13x38 -> 4x10 -> 1x3 -> 1x1 per hemicube, so only one texel per
+// hemicube needs reading back. Levels are sized per atlas cell.
+void reduceSetup() {
+  reduceProgram = glCreateProgram();
+  {
+    GLuint reduceVert = createShader("shaders/reduce.vert.glsl", GL_VERTEX_SHADER);
+    GLuint reduceFrag = createShader("shaders/reduce.frag.glsl", GL_FRAGMENT_SHADER);
+
+    glAttachShader(reduceProgram, reduceVert);
+    glAttachShader(reduceProgram, reduceFrag);
+
+    glLinkProgram(reduceProgram);
+
+    glDeleteShader(reduceVert);
+    glDeleteShader(reduceFrag);
+  }
+
+  glUseProgram(reduceProgram);
+  glUniform1i(glGetUniformLocation(reduceProgram, "source"), 0);
+  glUniform1i(glGetUniformLocation(reduceProgram, "multiplier"), 1);
+  glUniform1i(glGetUniformLocation(reduceProgram, "resolution"), hemicubeResolution);
+  glUseProgram(0);
+
+  // Attributeless; the vertex shader makes a fullscreen triangle from gl_VertexID.
+  glGenVertexArrays(1, &reduceVao);
+
+  int width = hemicubeTextureWidth;
+  int height = hemicubeTextureHeight;
+  while (width > 1 || height > 1) {
+    assert(reduceLevelCount < MAX_REDUCE_LEVELS);
+
+    width = (width + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    height = (height + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+
+    ReduceLevel* level = &reduceLevels[reduceLevelCount++];
+    level->width = width;
+    level->height = height;
+
+    glGenTextures(1, &level->texture);
+    glBindTexture(GL_TEXTURE_2D, level->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width * batchColumns, height * batchRows, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &level->frameBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, level->frameBuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, level->texture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  glGenTextures(1, &multiplierMapTexture);
+  glBindTexture(GL_TEXTURE_2D, multiplierMapTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, hemicubeResolution/2, MULTIPLIER_BANDS * hemicubeResolution/2, 0, GL_RED, GL_FLOAT, multiplierMap);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Leaves the weighted total of each hemicube in the atlas in the last
+// level's texel for its cell.
+void reduceHemicubes(GLuint colorBuffer) {
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_CULL_FACE);
+
+  glUseProgram(reduceProgram);
+  GLint weightedLoc = glGetUniformLocation(reduceProgram, "weighted");
+  GLint sourceCellLoc = glGetUniformLocation(reduceProgram, "source_cell");
+  GLint targetCellLoc = glGetUniformLocation(reduceProgram, "target_cell");
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, multiplierMapTexture);
+  glActiveTexture(GL_TEXTURE0);
+
+  glBindVertexArray(reduceVao);
+
+  GLuint source = colorBuffer;
+  int sourceWidth = hemicubeTextureWidth;
+  int sourceHeight = hemicubeTextureHeight;
+  for (int i = 0; i < reduceLevelCount; i++) {
+    ReduceLevel* level = &reduceLevels[i];
+
+    glBindFramebuffer(GL_FRAMEBUFFER, level->frameBuffer);
+    glViewport(0, 0, level->width * batchColumns, level->height * batchRows);
+
+    glBindTexture(GL_TEXTURE_2D, source);
+    glUniform1i(weightedLoc, i == 0);
+    glUniform2i(sourceCellLoc, sourceWidth, sourceHeight);
+    glUniform2i(targetCellLoc, level->width, level->height);
+
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    source = level->texture;
+    sourceWidth = level->width;
+    sourceHeight = level->height;
+  }
+
+  glBindVertexArray(0);
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+
+  glUseProgram(0);
+
+  glEnable(GL_DEPTH_TEST);
+  glEnable(GL_CULL_FACE);
+}
+
+Color reducedHemicubes[MAX_BATCH];
+
+void readHemicubes(HemicubeSlot* slot) {
+  if (readbackMode == READBACK_PBO) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pixelBuffer);
+  }
+
+  if (reduceMode == REDUCE_GPU) {
+    reduceHemicubes(slot->colorBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, reduceLevels[reduceLevelCount - 1].frameBuffer);
+
+    // One texel per cell, row by row, which is sample order. The last row
+    // of the grid may be only part used, and reading all of it would run
+    // past batchSize texels, so it's read separately.
+    int fullRows = batchSize / batchColumns;
+    int lastRow = batchSize % batchColumns;
+    glReadPixels(0, 0,
+                 batchColumns, fullRows,
+                 GL_RGB, GL_FLOAT,
+                 readbackMode == READBACK_PBO ? 0 : reducedHemicubes);
+    if (lastRow) {
+      size_t offset = sizeof(Color) * batchColumns * fullRows;
+      glReadPixels(0, fullRows,
+                   lastRow, 1,
+                   GL_RGB, GL_FLOAT,
+                   readbackMode == READBACK_PBO ? (void*) offset : (char*) reducedHemicubes + offset);
+    }
+  } else {
+    glBindFramebuffer(GL_FRAMEBUFFER, slot->frameBuffer);
+
+    // Cell by cell, so each hemicube lands contiguously for hemicubeAverage().
+    // Lower levels only fill the corner of their cell.
+    for (int i = 0; i < slot->sampleCount; i++) {
+      int resolution = hemicubeLevels[slot->samples[i].level].resolution;
+      size_t offset = sizeof(Color) * hemicubeTextureWidth * hemicubeTextureHeight * i;
+      glReadPixels(cellX(i), cellY(i),
+                   resolution, projectionHeight(resolution),
+                   GL_RGB, GL_FLOAT,
+                   readbackMode == READBACK_PBO ? (void*) offset : (char*) hemicubeTextureData + offset);
+    }
+  }
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  if (readbackMode == READBACK_PBO) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  slot->pending = true;
+}
+
+Color levelAverage(HemicubeLevel* l, Color* data) {
+  if (kernelMode == KERNEL_SIMD) {
+    return l->simdKernel(data, l->multiplierMap, l->resolution);
+  } else {
+    return l->scalarKernel(data, l->multiplierMap, l->resolution);
+  }
+}
+
+Color hemicubeAverage(Color* data, int level) {
+  return levelAverage(&hemicubeLevels[level], data);
+}
+
+// The brightest pixel of a hemicube against its weighted average. Near 1
+// when the light comes evenly from everywhere, large when a few pixels
+// carry it.
+float hemicubeVariation(Color* data, int resolution, Color avg) {
+  float peak = 0.0f;
+  for (int i = 0; i < resolution * projectionHeight(resolution); i++) {
+    peak = glm::max(peak, data[i].r + data[i].g + data[i].b);
+  }
+
+  float mean = avg.r + avg.g + avg.b;
+  return mean > 0.0f ? peak / mean : 0.0f;
+}
+
+void benchmarkKernels() {
+  const int iterations = 20000;
+  const int pixels = hemicubeTextureWidth * hemicubeTextureHeight;
+
+  Color* data = (Color*) malloc(sizeof(Color) * pixels);
+  for (int i = 0; i < pixels; i++) {
+    Color c = {(float) rand() / RAND_MAX, (float) rand() / RAND_MAX, (float) rand() / RAND_MAX};
+    data[i] = c;
+  }
+
+  // The generic rows run the same loops with the resolution read at runtime,
+  // to show what the specialization buys.
+  const char* names[] = {"scalar/generic", "scalar", "simd/generic", "simd"};
+  HemicubeLevel* level = &hemicubeLevels[0];
+  HemicubeKernel kernels[] = {hemicubeAverageScalar<0>, level->scalarKernel, hemicubeAverageSimd<0>, level->simdKernel};
+
+  printf("Resolution %d\n", hemicubeResolution);
+
+  Color results[ARRAY_LENGTH(kernels)];
+  for (int kernel = 0; kernel < ARRAY_LENGTH(kernels); kernel++) {
+    // Fold every result into the checksum so nothing gets optimized away.
+    Color checksum = {0.0f, 0.0f, 0.0f};
+
+    // Untimed warm-up, otherwise whichever kernel goes first pays for the
+    // cold caches and clock ramp-up.
+    for (int i = 0; i < iterations / 10; i++) {
+      checksum += kernels[kernel](data, level->multiplierMap, level->resolution);
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < iterations; i++) {
+      data[i % pixels].r += 1e-6f;
+      checksum += kernels[kernel](data, level->multiplierMap, level->resolution);
+    }
+    float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    results[kernel] = kernels[kernel](data, level->multiplierMap, level->resolution);
+
+    printf("%-14s %8.0f ns/hemicube %8.1f Mpixel/s (checksum %f)\n",
+           names[kernel],
+           seconds / iterations * 1e9,
+           (float) iterations * pixels / seconds / 1e6,
+           checksum.r + checksum.g + checksum.b);
+  }
+
+  printf("simd - scalar: %g %g %g\n",
+         results[3].r - results[1].r,
+         results[3].g - results[1].g,
+         results[3].b - results[1].b);
+
+  free(data);
+}
+
+void storeSample(HemicubeSample sample, Color avg) {
+  Rect rect = rects[sample.rect];
+  Color* texture = textureData[sample.rect];
+
+  int width = glm::length(rect.da) * texelDensity;
+  int x = sample.x;
+  int y = sample.y;
+
+  Color result = {avg.r * rect.color.r,
+                  avg.g * rect.color.g,
+                  avg.b * rect.color.b};
+  if (sample.rect == 0) {
+    result += SUN;
+  }
+  if (texelIrradiance[sample.rect]) {
+    texelIrradiance[sample.rect][y*width + x] = avg;
+  }
+  if (relaxation != 1.0f) {
+    Color old = texture[y*width + x];
+    result.r = glm::max(old.r + (result.r - old.r) * relaxation, 0.0f);
+    result.g = glm::max(old.g + (result.g - old.g) * relaxation, 0.0f);
+    result.b = glm::max(old.b + (result.b - old.b) * relaxation, 0.0f);
+  }
+  float change = fabs(texture[y*width + x].r - result.r)
+    + fabs(texture[y*width + x].g - result.g)
+    + fabs(texture[y*width + x].b - result.b);
+  passError += change;
+  texture[y*width + x] = result;
+
+  if (texelResidual[sample.rect]) {
+    float value = result.r + result.g + result.b;
+    float residual = value > 0.0f ? change / value : (change > 0.0f ? HUGE_VALF : 0.0f);
+    unsigned char& stable = texelStable[sample.rect][y*width + x];
+    texelResidual[sample.rect][y*width + x] = residual;
+    stable = residual <= SETTLED_CHANGE ? glm::min(stable + 1, 255) : 0;
+  }
+}
+
+void settleSetup() {
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    texelResidual[i] = (float*) malloc(sizeof(float) * width * height);
+    texelStable[i] = (unsigned char*) calloc(width * height, 1);
+    for (int j = 0; j < width * height; j++) {
+      texelResidual[i][j] = HUGE_VALF;
+    }
+  }
+}
+
+// Called at the start of each gathering pass.
+void beginSettling() {
+  passSkipped = 0;
+  revalidating = settledPass % SETTLED_REVALIDATE == 0;
+  settledPass++;
+}
+
+bool texelSettled(int rect, int index) {
+  if (!skipSettled || renderItems || revalidating || texelStable[rect][index] < SETTLED_PASSES) {
+    return false;
+  }
+  passSkipped++;
+  return true;
+}
+
+void reportSettling(int texels) {
+  if (skipSettled) {
+    printf("Skipped %d settled texels of %d (%.1f%%)%s\n", passSkipped, texels,
+           100.0f * passSkipped / texels, revalidating ? ", revalidating" : "");
+  }
+}
+
+// The CPU reduction also keeps adaptive resolution's variation up to date.
+Color averageSample(HemicubeSample sample, Color* data) {
+  Color avg = hemicubeAverage(data, sample.level);
+
+  if (adaptiveResolution) {
+    int width = glm::length(rects[sample.rect].da) * texelDensity;
+    texelVariation[sample.rect][sample.y*width + sample.x] =
+      hemicubeVariation(data, hemicubeLevels[sample.level].resolution, avg);
+  }
+
+  return avg;
+}
+
+void storeFormFactors(HemicubeSample sample, Color* data);
+
+// A read back hemicube, which holds texel ids when building form factors.
+void finishSample(HemicubeSample sample, Color* data) {
+  if (renderItems) {
+    storeFormFactors(sample, data);
+  } else {
+    storeSample(sample, averageSample(sample, data));
+  }
+}
+
+void finishHemicubes(HemicubeSlot* slot) {
+  if (readbackMode == READBACK_PBO) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pixelBuffer);
+    void* data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    for (int i = 0; i < slot->sampleCount; i++) {
+      if (reduceMode == REDUCE_GPU) {
+        storeSample(slot->samples[i], ((Color*) data)[i]);
+      } else {
+        finishSample(slot->samples[i], (Color*) data + hemicubeTextureWidth * hemicubeTextureHeight * i);
+      }
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  } else {
+    for (int i = 0; i < slot->sampleCount; i++) {
+      if (reduceMode == REDUCE_GPU) {
+        storeSample(slot->samples[i], reducedHemicubes[i]);
+      } else {
+        finishSample(slot->samples[i], hemicubeTextureData + hemicubeTextureWidth * hemicubeTextureHeight * i);
+      }
+    }
+  }
+
+  slot->pending = false;
+  slot->sampleCount = 0;
+}
+
+// Hands the slot being filled to the GPU and moves on to the next one.
+void submitHemicubes() {
+  HemicubeSlot* slot = &hemicubeSlots[nextHemicubeSlot];
+
+  readHemicubes(slot);
+
+  if (readbackMode == READBACK_SYNC) {
+    finishHemicubes(slot);
+  }
+
+  nextHemicubeSlot = (nextHemicubeSlot + 1) % readbackRingSize;
+}
+
+// Results are stored oldest first so the pass comes out the same as the
+// synchronous path, error sum included.
+void flushHemicubes() {
+  for (int i = 0; i < readbackRingSize; i++) {
+    HemicubeSlot* slot = &hemicubeSlots[(nextHemicubeSlot + i) % readbackRingSize];
+    if (slot->pending) {
+      finishHemicubes(slot);
+    }
+  }
+}
+
+GLuint createShader(const char* filename, GLenum shaderType) {
+  FILE* file = fopen(filename, "r");
+
   fseek(file, 0L, SEEK_END);
   long filesize = ftell(file);
   rewind(file);
 
-  char* body = (char*) malloc(filesize+1);
-  fread(body, 1, filesize, file);
-  body[filesize] = 0;
+  char* body = (char*) malloc(filesize+1);
+  fread(body, 1, filesize, file);
+  body[filesize] = 0;
+
+  GLuint shader = glCreateShader(shaderType);
+  glShaderSource(shader, 1, &body, NULL);
+  free(body);
+
+  glCompileShader(shader);
+
+  {
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+      GLint length;
+      glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+
+      char* error = (char*) malloc(length);
+      glGetShaderInfoLog(shader, length, NULL, error);
+
+      printf("body: %s\n", body);
+      printf("error: %s\n", error);
+      exit(1);
+    }
+  }
+
+
+  return shader;
+}
+
+void generateTextures() {
+  glGenTextures(ARRAY_LENGTH(textures), textures);
+  for (int i = 0; i < ARRAY_LENGTH(textures); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    textureData[i] = (Color*) malloc(sizeof(Color) * width * height * texelDensity * texelDensity);
+  }
+
+  resetTextureData();
+}
+
+// Back to the sun alone, before the first pass.
+void resetTextureData() {
+  for (int i = 0; i < ARRAY_LENGTH(textures); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    Color color;
+    if (i == 0) {
+      color = SUN;
+    } else {
+      color = BLACK;
+    }
+
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        textureData[i][y*width + x] = color;
+      }
+    }
+  }
+}
+
+void loadTextures() {
+  for (int i = 0; i < ARRAY_LENGTH(textures); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_FLOAT, textureData[i]);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    float border[3] = {0.0f, 1.0f, 1.0f};
+    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  }
+}
+
+// Loads one rect's texels into the texture loadTextures() made for it.
+void updateTexture(int rect) {
+  int width = glm::length(rects[rect].da) * texelDensity;
+  int height = glm::length(rects[rect].db) * texelDensity;
+
+  glBindTexture(GL_TEXTURE_2D, textures[rect]);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGB, GL_FLOAT, textureData[rect]);
+}
+
+// Renders a PROBE_RESOLUTION hemicube from every texel and keeps the
+// nearest depth it saw, which doesn't change between passes. Its colors
+// give pass 1 a variation to start from.
+void probeTexels() {
+  const int R = PROBE_RESOLUTION;
+  float* depths = (float*) malloc(sizeof(float) * R * 3*R);
+  Color* colors = (Color*) malloc(sizeof(Color) * R * 3*R);
+  HemicubeSlot* slot = &hemicubeSlots[0];
+
+  // Depth is read back from the atlas, which the layered path doesn't
+  // write, so the probe always draws face by face.
+  HemicubeRenderMode renderMode = hemicubeRenderMode;
+  hemicubeRenderMode = HEMICUBE_MULTIPASS;
+
+  int probeCount = 0;
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    Rect rect = rects[i];
+    vec3 norm = normal(rect);
+
+    int width = glm::length(rect.da) * texelDensity;
+    int height = glm::length(rect.db) * texelDensity;
+
+    vec3 da = rect.da / (float)width;
+    vec3 db = rect.db / (float)height;
+
+    texelDistance[i] = (float*) malloc(sizeof(float) * width * height);
+    texelVariation[i] = (float*) malloc(sizeof(float) * width * height);
+
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        vec3 location = rect.origin + da*(x+0.5f) + db*(y+0.5f);
+        renderHemicube(slot->frameBuffer, 0, 0, location, norm, R);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, slot->frameBuffer);
+        glReadPixels(0, 0, R, 3*R, GL_DEPTH_COMPONENT, GL_FLOAT, depths);
+
+        // Back to eye space depth, which is along each face's axis and so
+        // never more than the real distance.
+        float nearest = HEMICUBE_FAR;
+        for (int j = 0; j < R * 3*R; j++) {
+          float z = depths[j] * 2.0f - 1.0f;
+          float depth = 2.0f * HEMICUBE_NEAR * HEMICUBE_FAR / (HEMICUBE_FAR + HEMICUBE_NEAR - z * (HEMICUBE_FAR - HEMICUBE_NEAR));
+          nearest = glm::min(nearest, depth);
+        }
+        texelDistance[i][y*width + x] = nearest;
+
+        glReadPixels(0, 0, R, 3*R, GL_RGB, GL_FLOAT, colors);
+        texelVariation[i][y*width + x] = hemicubeVariation(colors, R, levelAverage(&probeLevel, colors));
+
+        probeCount++;
+      }
+    }
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  hemicubeRenderMode = renderMode;
+  free(depths);
+  free(colors);
+
+  float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  printf("Probed %d texels at resolution %d in %.2fs, %ld pixels\n",
+         probeCount, R, seconds, (long) probeCount * R * 3*R);
+}
+
+// Starts from the lowest level and goes up one for nearby geometry, and
+// one for each factor of ADAPTIVE_VARIATION in the variation: the smaller
+// the source carrying the light, the more its edge pixels matter.
+int chooseLevel(int rect, int x, int y, int width) {
+  int level = hemicubeLevelCount - 1;
+  if (texelDistance[rect][y*width + x] < ADAPTIVE_NEAR_DISTANCE) {
+    level--;
+  }
+  for (float v = ADAPTIVE_VARIATION; texelVariation[rect][y*width + x] > v; v *= ADAPTIVE_VARIATION) {
+    level--;
+  }
+  return glm::max(level, 0);
+}
+
+// Counts for the pass being rendered.
+int passHemicubeCount;
+int passLevelCounts[MAX_HEMICUBE_LEVELS];
+long passPixelCount;
+
+void queueHemicube(int rect, int x, int y) {
+  Rect r = rects[rect];
+  int width = glm::length(r.da) * texelDensity;
+  int height = glm::length(r.db) * texelDensity;
+  vec3 location = r.origin + r.da * ((x + 0.5f) / width) + r.db * ((y + 0.5f) / height);
+
+  // Reuse the oldest slot in the ring; by now the GPU has had
+  // readbackRingSize-1 other batches' worth of time to finish it.
+  HemicubeSlot* slot = &hemicubeSlots[nextHemicubeSlot];
+  if (slot->pending) {
+    finishHemicubes(slot);
+  }
+
+  int level = adaptiveResolution ? chooseLevel(rect, x, y, width) : 0;
+  int resolution = hemicubeLevels[level].resolution;
+
+  int cell = slot->sampleCount;
+  HemicubeSample sample = {rect, x, y, level};
+  renderProjection(slot->frameBuffer, cellX(cell), cellY(cell), location, normal(r), resolution);
+  slot->samples[slot->sampleCount++] = sample;
+  passHemicubeCount++;
+  passLevelCounts[level]++;
+  passPixelCount += resolution * projectionHeight(resolution);
+
+  if (slot->sampleCount == batchSize) {
+    submitHemicubes();
+  }
+}
+
+// Batches don't span rects. A pending slot keeps its samples until it is
+// finished, so only one still being filled is submitted here.
+void submitLastHemicubes() {
+  HemicubeSlot* last = &hemicubeSlots[nextHemicubeSlot];
+  if (!last->pending && last->sampleCount > 0) {
+    submitHemicubes();
+  }
+}
+
+struct SubdivisionCell {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+};
+
+// The rect being subdivided's texels: 0 to fill in, 1 sampled, 2 filled.
+unsigned char* texelSampled;
+SubdivisionCell* subdivisionCells[3];
+int subdivisionTexels;
+
+// The nearest point of each other rect that is in front of the texel and
+// faces it. Rects facing the same way are either in its plane or can't be
+// seen from it.
+float clearance(int rect, vec3 location) {
+  vec3 n = normal(rects[rect]);
+  float nearest = HEMICUBE_FAR;
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    Rect other = rects[i];
+    vec3 otherNormal = normal(other);
+    if (i == rect || glm::dot(n, otherNormal) > 0.9999f) {
+      continue;
+    }
+
+    vec3 offset = location - other.origin;
+    float u = glm::clamp(glm::dot(offset, other.da) / glm::dot(other.da, other.da), 0.0f, 1.0f);
+    float v = glm::clamp(glm::dot(offset, other.db) / glm::dot(other.db, other.db), 0.0f, 1.0f);
+    vec3 closest = other.origin + other.da * u + other.db * v;
+    if (glm::dot(n, closest - location) < -1e-4f || glm::dot(otherNormal, location - closest) < -1e-4f) {
+      continue;
+    }
+
+    nearest = glm::min(nearest, glm::length(closest - location));
+  }
+
+  return nearest;
+}
+
+void subdivisionSetup() {
+  int largest = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    Rect rect = rects[i];
+    int width = glm::length(rect.da) * texelDensity;
+    int height = glm::length(rect.db) * texelDensity;
+    largest = glm::max(largest, width * height);
+
+    texelIrradiance[i] = (Color*) calloc(width * height, sizeof(Color));
+    texelClearance[i] = (float*) malloc(sizeof(float) * width * height);
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        vec3 location = rect.origin + rect.da * ((x + 0.5f) / width) + rect.db * ((y + 0.5f) / height);
+        texelClearance[i][y*width + x] = clearance(i, location);
+      }
+    }
+  }
+
+  // Every cell has a corner of its own, so there are never more cells than
+  // texels.
+  texelSampled = (unsigned char*) malloc(largest);
+  for (int i = 0; i < 3; i++) {
+    subdivisionCells[i] = (SubdivisionCell*) malloc(sizeof(SubdivisionCell) * largest);
+  }
+}
+
+void sampleTexel(int rect, int x, int y, int width) {
+  if (!texelSampled[y*width + x]) {
+    texelSampled[y*width + x] = 1;
+    queueHemicube(rect, x, y);
+  }
+}
+
+bool needsSplit(int rect, SubdivisionCell cell, int width, int height) {
+  if (cell.x1 - cell.x0 <= 1 && cell.y1 - cell.y0 <= 1) {
+    return false;
+  }
+
+  int corners[4] = {cell.y0*width + cell.x0, cell.y0*width + cell.x1,
+                    cell.y1*width + cell.x0, cell.y1*width + cell.x1};
+  float lowest = HUGE_VALF;
+  float highest = 0.0f;
+  float sum = 0.0f;
+  float nearest = HEMICUBE_FAR;
+  for (int i = 0; i < 4; i++) {
+    Color c = texelIrradiance[rect][corners[i]];
+    float l = c.r + c.g + c.b;
+    lowest = glm::min(lowest, l);
+    highest = glm::max(highest, l);
+    sum += l;
+    nearest = glm::min(nearest, texelClearance[rect][corners[i]]);
+  }
+
+  float difference = highest - lowest;
+  if (difference > SUBDIVIDE_CONTRAST * sum / 4.0f) {
+    return true;
+  }
+
+  float dx = (float) (cell.x1 - cell.x0) / width * glm::length(rects[rect].da);
+  float dy = (float) (cell.y1 - cell.y0) / height * glm::length(rects[rect].db);
+  return sqrtf(dx*dx + dy*dy) > SUBDIVIDE_CLEARANCE * nearest;
+}
+
+int compareCellArea(const void* a, const void* b) {
+  const SubdivisionCell* p = (const SubdivisionCell*) a;
+  const SubdivisionCell* q = (const SubdivisionCell*) b;
+  return (p->x1 - p->x0) * (p->y1 - p->y0) - (q->x1 - q->x0) * (q->y1 - q->y0);
+}
+
+// Renders hemicubes for a rect one level of cells at a time, as each level
+// needs the last one's results to decide where to split.
+void subdivideRect(int rect) {
+  int width = glm::length(rects[rect].da) * texelDensity;
+  int height = glm::length(rects[rect].db) * texelDensity;
+
+  memset(texelSampled, 0, width * height);
+  subdivisionTexels += width * height;
+
+  SubdivisionCell* cells = subdivisionCells[0];
+  SubdivisionCell* next = subdivisionCells[1];
+  SubdivisionCell* done = subdivisionCells[2];
+  int cellCount = 0;
+  int doneCount = 0;
+
+  for (int y0 = 0; y0 < height; y0 += SUBDIVIDE_SPACING) {
+    int y1 = glm::min(y0 + SUBDIVIDE_SPACING, height - 1);
+    for (int x0 = 0; x0 < width; x0 += SUBDIVIDE_SPACING) {
+      int x1 = glm::min(x0 + SUBDIVIDE_SPACING, width - 1);
+      SubdivisionCell cell = {x0, y0, x1, y1};
+      cells[cellCount++] = cell;
+
+      sampleTexel(rect, x0, y0, width);
+      sampleTexel(rect, x1, y0, width);
+      sampleTexel(rect, x0, y1, width);
+      sampleTexel(rect, x1, y1, width);
+
+      // The last cell of a row or column reaches the far edge.
+      if (x1 == width - 1) {
+        break;
+      }
+    }
+    if (y1 == height - 1) {
+      break;
+    }
+  }
+
+  while (cellCount > 0) {
+    submitLastHemicubes();
+    flushHemicubes();
+
+    int nextCount = 0;
+    for (int i = 0; i < cellCount; i++) {
+      SubdivisionCell cell = cells[i];
+      if (!needsSplit(rect, cell, width, height)) {
+        done[doneCount++] = cell;
+        continue;
+      }
+
+      int xs[3] = {cell.x0, cell.x1 - cell.x0 > 1 ? (cell.x0 + cell.x1) / 2 : cell.x1, cell.x1};
+      int ys[3] = {cell.y0, cell.y1 - cell.y0 > 1 ? (cell.y0 + cell.y1) / 2 : cell.y1, cell.y1};
+      int columns = xs[1] == cell.x1 ? 1 : 2;
+      int rows = ys[1] == cell.y1 ? 1 : 2;
+
+      for (int j = 0; j < rows; j++) {
+        for (int k = 0; k < columns; k++) {
+          SubdivisionCell child = {xs[k], ys[j], xs[k + 1], ys[j + 1]};
+          next[nextCount++] = child;
+
+          sampleTexel(rect, child.x0, child.y0, width);
+          sampleTexel(rect, child.x1, child.y0, width);
+          sampleTexel(rect, child.x0, child.y1, width);
+          sampleTexel(rect, child.x1, child.y1, width);
+        }
+      }
+    }
+
+    SubdivisionCell* swap = cells;
+    cells = next;
+    next = swap;
+    cellCount = nextCount;
+  }
+
+  // Small cells first, so where a big cell's edge meets a split neighbour
+  // the texels come from the neighbour's finer cells.
+  qsort(done, doneCount, sizeof(SubdivisionCell), compareCellArea);
+
+  for (int i = 0; i < doneCount; i++) {
+    SubdivisionCell cell = done[i];
+    Color c00 = texelIrradiance[rect][cell.y0*width + cell.x0];
+    Color c10 = texelIrradiance[rect][cell.y0*width + cell.x1];
+    Color c01 = texelIrradiance[rect][cell.y1*width + cell.x0];
+    Color c11 = texelIrradiance[rect][cell.y1*width + cell.x1];
+
+    for (int y = cell.y0; y <= cell.y1; y++) {
+      for (int x = cell.x0; x <= cell.x1; x++) {
+        if (texelSampled[y*width + x]) {
+          continue;
+        }
+        texelSampled[y*width + x] = 2;
+
+        float fx = cell.x1 > cell.x0 ? (float) (x - cell.x0) / (cell.x1 - cell.x0) : 0.0f;
+        float fy = cell.y1 > cell.y0 ? (float) (y - cell.y0) / (cell.y1 - cell.y0) : 0.0f;
+        Color top = c00 * (1.0f - fx) + c10 * fx;
+        Color bottom = c01 * (1.0f - fx) + c11 * fx;
+
+        HemicubeSample sample = {rect, x, y, 0};
+        storeSample(sample, top * (1.0f - fy) + bottom * fy);
+      }
+    }
+  }
+}
+
+void radiosify() {
+  passError = 0.0f;
+  if (!renderItems) {
+    beginSettling();
+  }
+
+  passHemicubeCount = 0;
+  memset(passLevelCounts, 0, sizeof(passLevelCounts));
+  passPixelCount = 0;
+  subdivisionTexels = 0;
+  Uint64 start = SDL_GetPerformanceCounter();
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    {
+      SDL_Event event;
+
+      while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
+          exit(1);
+        }
+      }
+    }
+
+    printf("Rect %d\r", i);
+
+    if (samplingMode == SAMPLING_ADAPTIVE && !renderItems) {
+      subdivideRect(i);
+    } else {
+      int width = glm::length(rects[i].da) * texelDensity;
+      int height = glm::length(rects[i].db) * texelDensity;
+
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          if (!texelSettled(i, y*width + x)) {
+            queueHemicube(i, x, y);
+          }
+        }
+      }
+      submitLastHemicubes();
+    }
+
+    if (updateMode == UPDATE_GAUSS_SEIDEL && !renderItems) {
+      flushHemicubes();
+      updateTexture(i);
+    }
+  }
+
+  flushHemicubes();
+
+  float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+  printf("\n");
+  printf("Error: %f\n", passError);
+  printf("%d hemicubes in %.2fs, %.0f hemicubes/s (batch %d)\n",
+         passHemicubeCount, seconds, passHemicubeCount / seconds, batchSize);
+
+  if (!renderItems) {
+    reportSettling(passHemicubeCount + passSkipped);
+  }
+
+  if (samplingMode == SAMPLING_ADAPTIVE && !renderItems) {
+    printf("Sampled %d of %d texels, %d hemicubes saved (%.1f%%)\n",
+           passHemicubeCount, subdivisionTexels, subdivisionTexels - passHemicubeCount,
+           100.0f * (subdivisionTexels - passHemicubeCount) / subdivisionTexels);
+  }
 
-  GLuint shader = glCreateShader(shaderType);
-  glShaderSource(shader, 1, &body, NULL);
-  free(body);
+  if (adaptiveResolution) {
+    for (int i = 0; i < hemicubeLevelCount; i++) {
+      printf("%s%d at %d", i ? ", " : "", passLevelCounts[i], hemicubeLevels[i].resolution);
+    }
+    long fixedPixelCount = (long) passHemicubeCount * hemicubeTextureWidth * hemicubeTextureHeight;
+    printf("; %ld pixels, %.1f%% of %ld at fixed resolution\n",
+           passPixelCount, 100.0f * passPixelCount / fixedPixelCount, fixedPixelCount);
+  }
+}
 
-  glCompileShader(shader);
+// Bakes the same passes with every projection, and then with each CPU
+// gather, starting over each time, and compares each result with the
+// hemicube's. The sun is left out of the difference as its own light
+// swamps everything else.
+void compareProjections() {
+  const int renders[] = {HEMICUBE_FACES, 1, 3};
+  const int R = hemicubeResolution;
+  const GatherMode cpuGathers[] = {GATHER_RASTER, GATHER_RAYCAST};
+  const char* cpuGatherNames[] = {"raster", "raycast"};
+  const int projections = ARRAY_LENGTH(projectionNames);
+  const int rows = projections + ARRAY_LENGTH(cpuGathers);
+
+  Color* hemicubeData[ARRAY_LENGTH(rects)];
+  float seconds[rows];
+  float meanDifference[rows];
+  float maxDifference[rows];
+  GatherMode gather = gatherMode;
+
+  for (int p = 0; p < rows; p++) {
+    bool cpu = p >= projections;
+    projectionMode = cpu ? PROJECTION_HEMICUBE : (ProjectionMode) p;
+    gatherMode = cpu ? cpuGathers[p - projections] : gather;
+    prepareMultiplierMap();
+    resetTextureData();
+    loadTextures();
 
-  {
-    GLint status;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if (!status) {
-      GLint length;
-      glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    if (cpu) {
+      printf("Gather %s\n", cpuGatherNames[p - projections]);
+    } else {
+      printf("Projection %s\n", projectionNames[p]);
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < passes; i++) {
+      if (cpu) {
+        cpuGatherPass();
+      } else {
+        radiosify();
+      }
+      loadTextures();
+    }
+    seconds[p] = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    float total = 0.0f;
+    float difference = 0.0f;
+    float largest = 0.0f;
+    int texelCount = 0;
+    for (int i = 1; i < ARRAY_LENGTH(rects); i++) {
+      int width = glm::length(rects[i].da) * texelDensity;
+      int height = glm::length(rects[i].db) * texelDensity;
+
+      if (p == PROJECTION_HEMICUBE) {
+        hemicubeData[i] = (Color*) malloc(sizeof(Color) * width * height);
+        memcpy(hemicubeData[i], textureData[i], sizeof(Color) * width * height);
+      }
 
-      char* error = (char*) malloc(length);
-      glGetShaderInfoLog(shader, length, NULL, error);
+      for (int j = 0; j < width * height; j++) {
+        Color a = hemicubeData[i][j];
+        Color b = textureData[i][j];
+        float d = fabsf(b.r + b.g + b.b - a.r - a.g - a.b);
+        total += a.r + a.g + a.b;
+        difference += d;
+        largest = glm::max(largest, d);
+        texelCount++;
+      }
+    }
+    meanDifference[p] = difference / total;
+    maxDifference[p] = largest / (total / texelCount);
+  }
 
-      printf("body: %s\n", body);
-      printf("error: %s\n", error);
-      exit(1);
+  printf("\nResolution %d, %d passes; differences against the hemicube, relative to its mean\n", R, passes);
+  printf("%-12s %8s %8s %10s %10s %10s\n", "projection", "renders", "pixels", "seconds", "mean diff", "max diff");
+  for (int p = 0; p < rows; p++) {
+    // The rasterizer draws hemicubes; rays stand in for pixels.
+    bool cpu = p >= projections;
+    projectionMode = cpu ? PROJECTION_HEMICUBE : (ProjectionMode) p;
+    bool rays = cpu && cpuGathers[p - projections] == GATHER_RAYCAST;
+    printf("%-12s %8d %8d %9.2fs %9.2f%% %9.1f%%\n",
+           cpu ? cpuGatherNames[p - projections] : projectionNames[p],
+           rays ? 0 : renders[projectionMode], rays ? raysPerTexel : R * projectionHeight(R),
+           seconds[p], 100.0f * meanDifference[p], 100.0f * maxDifference[p]);
+  }
+  gatherMode = gather;
+}
+
+// Form factors as a sparse matrix, one compressed row per texel in
+// radiosify()'s order: the texels it sees, and the summed weight of the
+// pixels that saw each. Texels are numbered rect after rect from
+// texelOffset. These are the full precision rows being built; passes use
+// the quantized ones from the form factor file below.
+int texelCount;
+int texelOffset[ARRAY_LENGTH(rects)];
+int texelWidth[ARRAY_LENGTH(rects)];
+
+int* formFactorRows;
+int* formFactorColumns;
+float* formFactorWeights;
+long formFactorCount;
+long formFactorCapacity;
+
+// The form factor file: this header, then texelCount + 1 row starts, a
+// scale per row, a column per entry and a weight per entry, each weight a
+// 16-bit fraction of its row's largest. Only geometry and the settings
+// that change visibility go into the hash, so colors and emission can be
+// changed and re-solved from the same file.
+#define FORM_FACTOR_MAGIC "RADIOFF"
+#define FORM_FACTOR_VERSION 1
+
+struct FormFactorHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t texelCount;
+  uint64_t hash;
+  uint64_t entryCount;
+};
+
+const uint32_t* fileRows;
+const float* fileScales;
+const uint32_t* fileColumns;
+const uint16_t* fileWeights;
+
+// The full resolution level's weights, one per pixel.
+float* pixelWeights;
+
+// Scratch for one row: the weight so far of every texel, and which texels
+// have one.
+float* rowWeights;
+int* rowTexels;
+
+Color* texelColors;
+
+GLuint createItemProgram(const char* vertexShader) {
+  GLuint program = glCreateProgram();
+  GLuint itemVert = createShader(vertexShader, GL_VERTEX_SHADER);
+  GLuint itemFrag = createShader("shaders/item.frag.glsl", GL_FRAGMENT_SHADER);
+
+  glAttachShader(program, itemVert);
+  glAttachShader(program, itemFrag);
+
+  glBindAttribLocation(program, POSITION_ATTRIB, "position");
+  glBindAttribLocation(program, TEXCOORD_ATTRIB, "texcoord");
+
+  glLinkProgram(program);
+
+  glDeleteShader(itemVert);
+  glDeleteShader(itemFrag);
+
+  return program;
+}
+
+void formFactorSetup() {
+  itemProgram = createItemProgram("shaders/radiosity.vert.glsl");
+  if (projectionMode == PROJECTION_HEMISPHERE) {
+    hemisphereItemProgram = createItemProgram("shaders/radiosity_hemisphere.vert.glsl");
+    glUseProgram(hemisphereItemProgram);
+    glUniform1f(glGetUniformLocation(hemisphereItemProgram, "near"), HEMICUBE_NEAR);
+    glUniform1f(glGetUniformLocation(hemisphereItemProgram, "far"), HEMICUBE_FAR);
+    glUseProgram(0);
+  }
+
+  texelCount = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+    texelOffset[i] = texelCount;
+    texelWidth[i] = width;
+    texelCount += width * height;
+  }
+
+  rowWeights = (float*) calloc(texelCount, sizeof(float));
+  rowTexels = (int*) malloc(sizeof(int) * texelCount);
+  texelColors = (Color*) malloc(sizeof(Color) * texelCount);
+
+  // Unfolded from the level's map, see fillMultiplierMap() and friends.
+  HemicubeLevel* level = &hemicubeLevels[0];
+  const int R = level->resolution;
+  const int H = R/2;
+  const int height = projectionHeight(R);
+
+  pixelWeights = (float*) malloc(sizeof(float) * R * height);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < R; x++) {
+      float weight;
+      if (projectionMode == PROJECTION_TETRAHEDRON) {
+        weight = level->multiplierMap[(y % R) * R + x];
+      } else {
+        int band = y / R;
+        int qy = glm::max(y % R - H, H - 1 - y % R);
+        int qx = glm::max(x - H, H - 1 - x);
+        weight = level->multiplierMap[(band*H + qy) * H + qx];
+      }
+      pixelWeights[y*R + x] = weight;
+    }
+  }
+}
+
+int compareInts(const void* a, const void* b) {
+  return *(const int*) a - *(const int*) b;
+}
+
+void storeFormFactors(HemicubeSample sample, Color* data) {
+  const int R = hemicubeLevels[0].resolution;
+
+  int count = 0;
+  for (int i = 0; i < R * projectionHeight(R); i++) {
+    int item = (int) data[i].r;
+    if (item == 0 || pixelWeights[i] == 0.0f) {
+      continue;
+    }
+
+    int rect = item - 1;
+    int texel = texelOffset[rect] + (int) data[i].b * texelWidth[rect] + (int) data[i].g;
+    if (rowWeights[texel] == 0.0f) {
+      rowTexels[count++] = texel;
     }
+    rowWeights[texel] += pixelWeights[i];
   }
 
+  // In texel order, so a pass reads the lightmaps front to back.
+  qsort(rowTexels, count, sizeof(int), compareInts);
 
-  return shader;
+  if (formFactorCount + count > formFactorCapacity) {
+    formFactorCapacity = glm::max(2 * formFactorCapacity, formFactorCount + count);
+    formFactorColumns = (int*) realloc(formFactorColumns, sizeof(int) * formFactorCapacity);
+    formFactorWeights = (float*) realloc(formFactorWeights, sizeof(float) * formFactorCapacity);
+  }
+
+  // Samples finish in the order they were rendered, so rows are appended
+  // in order.
+  int row = texelOffset[sample.rect] + sample.y * texelWidth[sample.rect] + sample.x;
+  formFactorRows[row] = formFactorCount;
+  for (int i = 0; i < count; i++) {
+    formFactorColumns[formFactorCount] = rowTexels[i];
+    formFactorWeights[formFactorCount] = rowWeights[rowTexels[i]];
+    formFactorCount++;
+    rowWeights[rowTexels[i]] = 0.0f;
+  }
+  formFactorRows[row + 1] = formFactorCount;
 }
 
-void generateTextures() {
-  glGenTextures(ARRAY_LENGTH(textures), textures);
-  for (int i = 0; i < ARRAY_LENGTH(textures); i++) {
-    int width = glm::length(rects[i].da) * TEXEL_DENSITY;
-    int height = glm::length(rects[i].db) * TEXEL_DENSITY;
+// FNV-1a.
+uint64_t hashBytes(uint64_t hash, const void* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ ((const unsigned char*) data)[i]) * 1099511628211ull;
+  }
+  return hash;
+}
 
-    textureData[i] = (Color*) malloc(sizeof(Color) * width * height * TEXEL_DENSITY * TEXEL_DENSITY);
+uint64_t formFactorHash() {
+  uint64_t hash = 14695981039346656037ull;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    hash = hashBytes(hash, &rects[i].origin, sizeof(vec3));
+    hash = hashBytes(hash, &rects[i].da, sizeof(vec3));
+    hash = hashBytes(hash, &rects[i].db, sizeof(vec3));
+  }
+  int settings[] = {projectionMode, hemicubeResolution, texelDensity};
+  return hashBytes(hash, settings, sizeof(settings));
+}
 
-    Color color;
-    if (i == 0) {
-      color = SUN;
-    } else {
-      color = BLACK;
+size_t formFactorFileSize(uint64_t texelCount, uint64_t entryCount) {
+  return sizeof(FormFactorHeader)
+    + sizeof(uint32_t) * (texelCount + 1)
+    + sizeof(float) * texelCount
+    + sizeof(uint32_t) * entryCount
+    + sizeof(uint16_t) * entryCount;
+}
+
+void useFormFactorFile(const char* data) {
+  const FormFactorHeader* header = (const FormFactorHeader*) data;
+  const char* p = data + sizeof(FormFactorHeader);
+  fileRows = (const uint32_t*) p;
+  p += sizeof(uint32_t) * (header->texelCount + 1);
+  fileScales = (const float*) p;
+  p += sizeof(float) * header->texelCount;
+  fileColumns = (const uint32_t*) p;
+  p += sizeof(uint32_t) * header->entryCount;
+  fileWeights = (const uint16_t*) p;
+}
+
+// Maps the file for this geometry if there is one and it matches.
+bool loadFormFactors(const char* path, uint64_t hash) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat info;
+  FormFactorHeader header;
+  bool valid = fstat(fd, &info) == 0
+    && read(fd, &header, sizeof(header)) == sizeof(header)
+    && !memcmp(header.magic, FORM_FACTOR_MAGIC, sizeof(header.magic))
+    && header.version == FORM_FACTOR_VERSION
+    && header.hash == hash
+    && header.texelCount == texelCount
+    && (size_t) info.st_size == formFactorFileSize(header.texelCount, header.entryCount);
+
+  void* data = valid ? mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    printf("Ignoring %s: not form factors for this scene\n", path);
+    return false;
+  }
+
+  useFormFactorFile((const char*) data);
+  printf("Form factors from %s: %llu entries, %.1f MB\n",
+         path, (unsigned long long) header.entryCount, info.st_size / 1e6f);
+  return true;
+}
+
+// Quantizes the rows just built into the file layout, and keeps that in
+// memory whether or not it could be saved, so a fresh bake solves with
+// the same weights a cached one will.
+void saveFormFactors(const char* path, uint64_t hash) {
+  size_t size = formFactorFileSize(texelCount, formFactorCount);
+  char* data = (char*) malloc(size);
+
+  FormFactorHeader* header = (FormFactorHeader*) data;
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, FORM_FACTOR_MAGIC, sizeof(header->magic));
+  header->version = FORM_FACTOR_VERSION;
+  header->texelCount = texelCount;
+  header->hash = hash;
+  header->entryCount = formFactorCount;
+
+  useFormFactorFile(data);
+  uint32_t* rows = (uint32_t*) fileRows;
+  float* scales = (float*) fileScales;
+  uint16_t* weights = (uint16_t*) fileWeights;
+
+  memcpy(rows, formFactorRows, sizeof(uint32_t) * (texelCount + 1));
+  memcpy((uint32_t*) fileColumns, formFactorColumns, sizeof(uint32_t) * formFactorCount);
+
+  for (int row = 0; row < texelCount; row++) {
+    float largest = 0.0f;
+    for (int k = rows[row]; k < rows[row + 1]; k++) {
+      largest = glm::max(largest, formFactorWeights[k]);
+    }
+    scales[row] = largest / 65535.0f;
+    for (int k = rows[row]; k < rows[row + 1]; k++) {
+      weights[k] = (uint16_t) roundf(formFactorWeights[k] / scales[row]);
+    }
+  }
+
+  free(formFactorRows);
+  free(formFactorColumns);
+  free(formFactorWeights);
+  formFactorRows = NULL;
+  formFactorColumns = NULL;
+  formFactorWeights = NULL;
+
+  // Written beside and renamed over, so a half written file is never read.
+  char temporary[256];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+  FILE* file = fopen(temporary, "wb");
+  if (file && fwrite(data, 1, size, file) == size && fclose(file) == 0 && rename(temporary, path) == 0) {
+    printf("Saved form factors to %s, %.1f MB\n", path, size / 1e6f);
+  } else {
+    printf("Couldn't save form factors to %s\n", path);
+  }
+}
+
+void prepareFormFactors() {
+  uint64_t hash = formFactorHash();
+  char path[64];
+  snprintf(path, sizeof(path), "formfactors-%016llx.bin", (unsigned long long) hash);
+
+  if (loadFormFactors(path, hash)) {
+    return;
+  }
+
+  formFactorRows = (int*) malloc(sizeof(int) * (texelCount + 1));
+  formFactorCount = 0;
+
+  Uint64 start = SDL_GetPerformanceCounter();
+  renderItems = true;
+  radiosify();
+  renderItems = false;
+  float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+  printf("Form factors for %d texels in %.2fs: %ld entries, %.0f per texel\n",
+         texelCount, seconds, formFactorCount, (float) formFactorCount / texelCount);
+
+  saveFormFactors(path, hash);
+}
+
+// What a render gathers of a lightmap texel, as the textures are 8-bit.
+float unorm8(float v) {
+  return roundf(glm::clamp(v, 0.0f, 1.0f) * 255.0f) / 255.0f;
+}
+
+Color sampledColor(Color c) {
+  Color seen = {unorm8(c.r), unorm8(c.g), unorm8(c.b)};
+  return seen;
+}
+
+void applyFormFactors() {
+  passError = 0.0f;
+  beginSettling();
+
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  // Everything is gathered from the lightmaps as they were at the start of
+  // the pass, as with rendering, except that Gauss-Seidel replaces each
+  // texel's color as soon as it is updated.
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int height = glm::length(rects[i].db) * texelDensity;
+    for (int j = 0; j < texelWidth[i] * height; j++) {
+      texelColors[texelOffset[i] + j] = sampledColor(textureData[i][j]);
     }
+  }
 
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int height = glm::length(rects[i].db) * texelDensity;
     for (int y = 0; y < height; y++) {
-      for (int x = 0; x < width; x++) {
-        textureData[i][y*width + x] = color;
+      for (int x = 0; x < texelWidth[i]; x++) {
+        int row = texelOffset[i] + y * texelWidth[i] + x;
+        if (texelSettled(i, y * texelWidth[i] + x)) {
+          continue;
+        }
+
+        Color avg = {0.0f, 0.0f, 0.0f};
+        for (uint32_t k = fileRows[row]; k < fileRows[row + 1]; k++) {
+          avg += texelColors[fileColumns[k]] * (float) fileWeights[k];
+        }
+        avg = avg * fileScales[row];
+
+        HemicubeSample sample = {i, x, y, 0};
+        storeSample(sample, avg);
+
+        if (updateMode == UPDATE_GAUSS_SEIDEL) {
+          texelColors[row] = sampledColor(textureData[i][y * texelWidth[i] + x]);
+        }
       }
     }
   }
+
+  float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+  printf("Error: %f\n", passError);
+  printf("%d texels from form factors in %.3fs\n", texelCount - passSkipped, seconds);
+  reportSettling(texelCount);
 }
 
-void loadTextures() {
-  for (int i = 0; i < ARRAY_LENGTH(textures); i++) {
-    int width = glm::length(rects[i].da) * TEXEL_DENSITY;
-    int height = glm::length(rects[i].db) * TEXEL_DENSITY;
+// Light each texel has received but not yet shot on, numbered like the
+// form factors' texels.
+Color* unshotLight;
 
-    glBindTexture(GL_TEXTURE_2D, textures[i]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_FLOAT, textureData[i]);
+void shoot() {
+  const int R = hemicubeLevels[0].resolution;
+  const int height = projectionHeight(R);
+  HemicubeSlot* slot = &hemicubeSlots[0];
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    float border[3] = {0.0f, 1.0f, 1.0f};
-    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+  float texelArea[ARRAY_LENGTH(rects)];
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int rows = glm::length(rects[i].db) * texelDensity;
+    texelArea[i] = glm::length(rects[i].da) * glm::length(rects[i].db) / (texelWidth[i] * rows);
+  }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  // Emitters shoot what a gather would see of them, so both solvers light
+  // the scene alike.
+  unshotLight = (Color*) malloc(sizeof(Color) * texelCount);
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int rows = glm::length(rects[i].db) * texelDensity;
+    for (int j = 0; j < texelWidth[i] * rows; j++) {
+      unshotLight[texelOffset[i] + j] = sampledColor(textureData[i][j]);
+    }
+  }
+
+  const int maxShots = passes * texelCount;
+  const float threshold = tolerance > 0.0f ? tolerance : SHOOT_THRESHOLD;
+  const int checkpoint = glm::max(1, texelCount / 20);
+
+  float initialEnergy = -1.0f;
+  float added = 0.0f;
+  int shots = 0;
+
+  renderItems = true;
+  Uint64 start = SDL_GetPerformanceCounter();
+  while (shots < maxShots) {
+    // The texel with the most unshot light for its area, and how much is
+    // left over all.
+    int shooterRect = 0;
+    int shooter = 0;
+    float largest = 0.0f;
+    float remaining = 0.0f;
+    for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+      int rows = glm::length(rects[i].db) * texelDensity;
+      for (int j = 0; j < texelWidth[i] * rows; j++) {
+        Color u = unshotLight[texelOffset[i] + j];
+        float energy = (u.r + u.g + u.b) * texelArea[i];
+        remaining += energy;
+        if (energy > largest) {
+          largest = energy;
+          shooterRect = i;
+          shooter = j;
+        }
+      }
+    }
+
+    if (initialEnergy < 0.0f) {
+      initialEnergy = remaining;
+    }
+    if (remaining <= threshold * initialEnergy) {
+      break;
+    }
+
+    Rect rect = rects[shooterRect];
+    int x = shooter % texelWidth[shooterRect];
+    int y = shooter / texelWidth[shooterRect];
+    int rows = glm::length(rect.db) * texelDensity;
+    vec3 location = rect.origin
+      + rect.da * ((x + 0.5f) / texelWidth[shooterRect])
+      + rect.db * ((y + 0.5f) / rows);
+
+    // Rects are one sided, and the sun is outside the walls: with culling
+    // it would shoot through their backs, lighting texels that can't see
+    // it when gathering.
+    glDisable(GL_CULL_FACE);
+    renderProjection(slot->frameBuffer, 0, 0, location, normal(rect), R);
+    glEnable(GL_CULL_FACE);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, slot->frameBuffer);
+    glReadPixels(0, 0, R, height, GL_RGB, GL_FLOAT, hemicubeTextureData);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    Color light = unshotLight[texelOffset[shooterRect] + shooter];
+    unshotLight[texelOffset[shooterRect] + shooter] = BLACK;
+
+    // A pixel's weight is the form factor from the shooter to the bit of
+    // texel it sees; by reciprocity the texel gets that much of the light
+    // per unit of the shooter's area.
+    for (int i = 0; i < R * height; i++) {
+      Color item = hemicubeTextureData[i];
+      if (item.r == 0.0f || pixelWeights[i] == 0.0f) {
+        continue;
+      }
+
+      int receiver = (int) item.r - 1;
+      int texel = (int) item.b * texelWidth[receiver] + (int) item.g;
+      float share = pixelWeights[i] * texelArea[shooterRect] / texelArea[receiver];
+      Color color = rects[receiver].color;
+      Color delta = {light.r * color.r * share, light.g * color.g * share, light.b * color.b * share};
+
+      textureData[receiver][texel] += delta;
+      unshotLight[texelOffset[receiver] + texel] += delta;
+      added += delta.r + delta.g + delta.b;
+    }
+
+    shots++;
+
+    if (shots % checkpoint == 0) {
+      float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+      printf("%d shots in %.2fs, %.2f passes of hemicubes: added %f, %.2f%% unshot\n",
+             shots, seconds, (float) shots / texelCount, added, 100.0f * remaining / initialEnergy);
+      added = 0.0f;
+
+      renderItems = false;
+      loadTextures();
+      setWindowSize();
+      renderScene();
+      renderItems = true;
+    }
+  }
+  renderItems = false;
+
+  float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+  printf("Shot %d texels in %.2fs, %.0f shots/s\n", shots, seconds, shots / seconds);
+
+  loadTextures();
+  setWindowSize();
+  renderScene();
+}
+
+// Lightmaps as they were before the pass, and how much each rect's light
+// changed in this pass and the one before.
+Color* previousTextureData[ARRAY_LENGTH(rects)];
+float rectChange[ARRAY_LENGTH(rects)];
+float previousRectChange[ARRAY_LENGTH(rects)];
+
+// The ratio of a pass's change to the last one's, capped so a noisy
+// estimate can't blow up the extrapolated tail.
+float changeRatio(float change, float previous) {
+  if (previous <= 0.0f) {
+    return 0.0f;
   }
+  return glm::min(change / previous, MAX_EXTRAPOLATION_RATIO);
 }
 
-void radiosify() {
-  float error = 0.0f;
+void beginPass() {
+  if (tolerance <= 0.0f && !extrapolate) {
+    return;
+  }
+
   for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
-    {
-      SDL_Event event;
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
 
-      while (SDL_PollEvent(&event)) {
-        if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
-          exit(1);
-        }
+    if (!previousTextureData[i]) {
+      previousTextureData[i] = (Color*) malloc(sizeof(Color) * width * height);
+    }
+    memcpy(previousTextureData[i], textureData[i], sizeof(Color) * width * height);
+  }
+}
+
+// Whether the pass just run brings the residual below the tolerance. With
+// extrapolation the residual is the estimated change still to come rather
+// than the last pass's. The sun is left out, as its own light would swamp
+// the reflected light being measured.
+bool converged(int pass) {
+  if (tolerance <= 0.0f && !extrapolate) {
+    return false;
+  }
+
+  float totalChange = 0.0f;
+  float totalPrevious = 0.0f;
+  float totalLight = 0.0f;
+  float worst = 0.0f;
+  int worstRect = 1;
+
+  for (int i = 1; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    float change = 0.0f;
+    float light = 0.0f;
+    for (int j = 0; j < width * height; j++) {
+      Color b = textureData[i][j];
+      Color a = previousTextureData[i][j];
+      change += fabsf(b.r - a.r) + fabsf(b.g - a.g) + fabsf(b.b - a.b);
+      light += b.r + b.g + b.b;
+    }
+
+    previousRectChange[i] = pass > 0 ? rectChange[i] : 0.0f;
+    rectChange[i] = change;
+
+    float remaining = change;
+    if (extrapolate && pass > 0) {
+      float ratio = changeRatio(change, previousRectChange[i]);
+      remaining = change * ratio / (1.0f - ratio);
+    }
+    float residual = light > 0.0f ? remaining / light : 0.0f;
+    if (residual > worst) {
+      worst = residual;
+      worstRect = i;
+    }
+
+    totalChange += change;
+    totalPrevious += previousRectChange[i];
+    totalLight += light;
+  }
+
+  float ratio = changeRatio(totalChange, totalPrevious);
+  float residual = totalChange / totalLight;
+  if (extrapolate && pass > 0) {
+    residual = totalChange * ratio / (1.0f - ratio) / totalLight;
+  }
+
+  if (residualMode == RESIDUAL_RECT) {
+    printf("Residual: %.3f%% on rect %d, ratio %.3f\n", 100.0f * worst, worstRect, ratio);
+    residual = worst;
+  } else {
+    printf("Residual: %.3f%%, ratio %.3f\n", 100.0f * residual, ratio);
+  }
+
+  // One pass gives no ratio to go on, and only has the direct light.
+  if (tolerance <= 0.0f || pass == 0 || residual >= tolerance) {
+    return false;
+  }
+
+  printf("Converged after %d passes\n", pass + 1);
+  return true;
+}
+
+// Adds on what the remaining passes would: each texel keeps changing the
+// way it did in the last pass, shrinking by the ratio each time.
+void extrapolateLight() {
+  float totalChange = 0.0f;
+  float totalPrevious = 0.0f;
+  for (int i = 1; i < ARRAY_LENGTH(rects); i++) {
+    totalChange += rectChange[i];
+    totalPrevious += previousRectChange[i];
+  }
+
+  for (int i = 1; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    float ratio = residualMode == RESIDUAL_RECT
+      ? changeRatio(rectChange[i], previousRectChange[i])
+      : changeRatio(totalChange, totalPrevious);
+    float scale = ratio / (1.0f - ratio);
+
+    for (int j = 0; j < width * height; j++) {
+      Color b = textureData[i][j];
+      Color a = previousTextureData[i][j];
+      Color tail = {(b.r - a.r) * scale, (b.g - a.g) * scale, (b.b - a.b) * scale};
+      textureData[i][j] = b + tail;
+    }
+  }
+}
+
+// Solves A x = b in place by Gaussian elimination with partial pivoting.
+void solveDense(float* a, float* b, int n) {
+  for (int k = 0; k < n; k++) {
+    int pivot = k;
+    for (int i = k + 1; i < n; i++) {
+      if (fabsf(a[i*n + k]) > fabsf(a[pivot*n + k])) {
+        pivot = i;
+      }
+    }
+    if (pivot != k) {
+      for (int j = 0; j < n; j++) {
+        float t = a[k*n + j];
+        a[k*n + j] = a[pivot*n + j];
+        a[pivot*n + j] = t;
       }
+      float t = b[k];
+      b[k] = b[pivot];
+      b[pivot] = t;
     }
 
-    printf("Rect %d\r", i);
+    for (int i = k + 1; i < n; i++) {
+      float f = a[i*n + k] / a[k*n + k];
+      for (int j = k; j < n; j++) {
+        a[i*n + j] -= f * a[k*n + j];
+      }
+      b[i] -= f * b[k];
+    }
+  }
+
+  for (int k = n - 1; k >= 0; k--) {
+    for (int j = k + 1; j < n; j++) {
+      b[k] -= a[k*n + j] * b[j];
+    }
+    b[k] /= a[k*n + k];
+  }
+}
+
+void warmStartRects() {
+  const int N = ARRAY_LENGTH(rects);
+  const int S = WARM_START_SAMPLES;
+  const int R = hemicubeLevels[0].resolution;
+  const int height = projectionHeight(R);
+  HemicubeSlot* slot = &hemicubeSlots[0];
+
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  // Each rect's form factor to every other, averaged over its samples.
+  float* formFactors = (float*) calloc(N * N, sizeof(float));
+  renderItems = true;
+  for (int i = 0; i < N; i++) {
     Rect rect = rects[i];
-    Color* texture = textureData[i];
+    for (int sy = 0; sy < S; sy++) {
+      for (int sx = 0; sx < S; sx++) {
+        vec3 location = rect.origin + rect.da * ((sx + 0.5f) / S) + rect.db * ((sy + 0.5f) / S);
+        renderProjection(slot->frameBuffer, 0, 0, location, normal(rect), R);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, slot->frameBuffer);
+        glReadPixels(0, 0, R, height, GL_RGB, GL_FLOAT, hemicubeTextureData);
+
+        for (int p = 0; p < R * height; p++) {
+          int item = (int) hemicubeTextureData[p].r;
+          if (item != 0) {
+            formFactors[i*N + item - 1] += pixelWeights[p] / (S * S);
+          }
+        }
+      }
+    }
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  renderItems = false;
+
+  Uint64 rendered = SDL_GetPerformanceCounter();
+
+  // B_i - color_i sum_j F_ij B_j = 0 for every rect but the sun, which is
+  // held at what a gather sees of it.
+  float* a = (float*) malloc(sizeof(float) * N * N);
+  float b[3][ARRAY_LENGTH(rects)];
+  Color sun = sampledColor(SUN);
+  for (int c = 0; c < 3; c++) {
+    for (int i = 0; i < N; i++) {
+      float color = (&rects[i].color.r)[c];
+      for (int j = 0; j < N; j++) {
+        a[i*N + j] = (i == j ? 1.0f : 0.0f) - (i == 0 ? 0.0f : color * formFactors[i*N + j]);
+      }
+      b[c][i] = i == 0 ? (&sun.r)[c] : 0.0f;
+    }
+    solveDense(a, b[c], N);
+  }
 
-    vec3 norm = normal(rect);
+  float reflected = 0.0f;
+  for (int i = 1; i < N; i++) {
+    Color radiosity = {b[0][i], b[1][i], b[2][i]};
+    int width = glm::length(rects[i].da) * texelDensity;
+    int rows = glm::length(rects[i].db) * texelDensity;
+    for (int j = 0; j < width * rows; j++) {
+      textureData[i][j] = radiosity;
+    }
+    reflected += (radiosity.r + radiosity.g + radiosity.b) * width * rows;
+  }
 
-    int width = glm::length(rect.da) * TEXEL_DENSITY;
-    int height = glm::length(rect.db) * TEXEL_DENSITY;
+  free(a);
+  free(formFactors);
 
-    vec3 da = rect.da / (float)width;
-    vec3 db = rect.db / (float)height;
+  Uint64 end = SDL_GetPerformanceCounter();
+  float frequency = SDL_GetPerformanceFrequency();
+  printf("Warm start from %d hemicubes in %.2fs, solved in %.4fs: reflected %f\n",
+         N * S * S, (rendered - start) / frequency, (end - rendered) / frequency, reflected);
+}
+
+// Resamples the lightmaps to a new density, bilinearly between the old
+// texel centers.
+void setTexelDensity(int density) {
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int oldWidth = glm::length(rects[i].da) * texelDensity;
+    int oldHeight = glm::length(rects[i].db) * texelDensity;
+    int width = glm::length(rects[i].da) * density;
+    int height = glm::length(rects[i].db) * density;
 
+    Color* old = textureData[i];
+    Color* data = (Color*) malloc(sizeof(Color) * width * height);
     for (int y = 0; y < height; y++) {
+      float sy = glm::clamp((y + 0.5f) * oldHeight / height - 0.5f, 0.0f, oldHeight - 1.0f);
+      int y0 = (int) sy;
+      int y1 = glm::min(y0 + 1, oldHeight - 1);
+      float fy = sy - y0;
+
       for (int x = 0; x < width; x++) {
-        vec3 location = rect.origin + da*(x+0.5f) + db*(y+0.5f);
-        renderHemicube(location, norm);
-        Color avg = hemicubeAverage();
-        Color result = {avg.r * rect.color.r,
-                        avg.g * rect.color.g,
-                        avg.b * rect.color.b};
-        if (i == 0) {
-          result += SUN;
-        }
-        error += fabs(texture[y*width + x].r - result.r)
-          + fabs(texture[y*width + x].g - result.g)
-          + fabs(texture[y*width + x].b - result.b);
-        texture[y*width + x] = result;
+        float sx = glm::clamp((x + 0.5f) * oldWidth / width - 0.5f, 0.0f, oldWidth - 1.0f);
+        int x0 = (int) sx;
+        int x1 = glm::min(x0 + 1, oldWidth - 1);
+        float fx = sx - x0;
+
+        Color top = old[y0*oldWidth + x0] * (1.0f - fx) + old[y0*oldWidth + x1] * fx;
+        Color bottom = old[y1*oldWidth + x0] * (1.0f - fx) + old[y1*oldWidth + x1] * fx;
+        data[y*width + x] = top * (1.0f - fy) + bottom * fy;
       }
     }
+
+    free(old);
+    textureData[i] = data;
+
+    free(previousTextureData[i]);
+    previousTextureData[i] = NULL;
   }
 
-  printf("\n");
-  printf("Error: %f\n", error);
+  texelDensity = density;
+}
+
+#if defined(HEADLESS)
+bool createHeadlessContext() {
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (!getPlatformDisplay) {
+    return false;
+  }
+
+  EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+    return false;
+  }
+
+  EGLint attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 2,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+  if (context == EGL_NO_CONTEXT) {
+    return false;
+  }
+
+  return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+#endif
+
+// Little-endian float RGB, rows bottom to top, which is the lightmaps'
+// own order: row 0 runs along the rect's origin.
+void writeLightmaps(const char* directory) {
+  mkdir(directory, 0755);
+
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/lightmap-%02d.pfm", directory, i);
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+      printf("Can't write %s\n", path);
+      exit(1);
+    }
+
+    fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+    fwrite(textureData[i], sizeof(Color), width * height, file);
+    fclose(file);
+  }
+
+  printf("Wrote %d lightmaps to %s\n", (int) ARRAY_LENGTH(rects), directory);
 }
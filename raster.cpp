@@ -0,0 +1,421 @@
+// Hemicubes rasterized on the CPU, each worker thread rendering its own one
+// at a time into an R x 3R buffer laid out like an atlas cell, with the
+// cameras and frusta renderHemicube() uses, so every pixel takes the same
+// multiplierMap weight it would on the GPU.
+//
+// Each face's quads are clipped in clip space and binned into RASTER_TILE x
+// RASTER_TILE tiles of the face, which are then rasterized a tile at a
+// time, four pixels at once, by the edge functions of the clipped quads.
+// A quad stays flat however it is clipped, so it is drawn as one convex
+// polygon rather than split into triangles. Only depth is stored: a first
+// pass over the tiles finds the nearest surface at every pixel, and a
+// second adds the weighted color of whichever quad has that depth there,
+// so the hemicube's image never exists, only its weighted sum.
+#define RASTER_TILE 16
+
+// A quad clipped by five planes has at most nine corners.
+#define MAX_CLIPPED_VERTICES 9
+
+struct RasterPolygon {
+  int rect;
+  // Its lightmap's size in texels.
+  int width;
+  int height;
+  // The pixels it may cover, [x0, x1) by [y0, y1).
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+  // Planes a*x + b*y + c over the buffer: an edge function per edge, all
+  // positive inside, then 1/w, u/w and v/w.
+  int edgeCount;
+  float edges[MAX_CLIPPED_VERTICES][3];
+  float planes[3][3];
+};
+
+struct RasterBuffers {
+  float* depth;
+  RasterPolygon* polygons;
+  int polygonCount;
+  // Polygon indices per tile, room for every rect in each.
+  int* bins;
+  int* binCounts;
+};
+
+RasterBuffers rasterBuffers[MAX_GATHER_THREADS];
+
+// multiplierMap unfolded over a whole cell, a weight per pixel.
+float* rasterWeights;
+
+struct ClipVertex {
+  glm::vec4 position;
+  float u;
+  float v;
+};
+
+// The inside of each plane is where dot(plane, position) >= 0:
+// x <= w, x >= -w, y <= w, y >= -w and the near plane, z >= -w.
+const glm::vec4 clipPlanes[] = {
+  glm::vec4(-1.0f, 0.0f, 0.0f, 1.0f),
+  glm::vec4(1.0f, 0.0f, 0.0f, 1.0f),
+  glm::vec4(0.0f, -1.0f, 0.0f, 1.0f),
+  glm::vec4(0.0f, 1.0f, 0.0f, 1.0f),
+  glm::vec4(0.0f, 0.0f, 1.0f, 1.0f)
+};
+
+int clipPolygon(const ClipVertex* in, int count, ClipVertex* out, glm::vec4 plane) {
+  int outCount = 0;
+
+  for (int i = 0; i < count; i++) {
+    const ClipVertex& a = in[i];
+    const ClipVertex& b = in[(i + 1) % count];
+    float da = glm::dot(plane, a.position);
+    float db = glm::dot(plane, b.position);
+
+    if (da >= 0.0f) {
+      out[outCount++] = a;
+    }
+    if ((da >= 0.0f) != (db >= 0.0f)) {
+      float t = da / (da - db);
+      ClipVertex c = {a.position + (b.position - a.position) * t,
+                      a.u + (b.u - a.u) * t,
+                      a.v + (b.v - a.v) * t};
+      out[outCount++] = c;
+    }
+  }
+
+  return outCount;
+}
+
+void rasterSetup() {
+  const int R = hemicubeResolution;
+  const int H = R/2;
+
+  // A quadrant of weights for each of the three bands.
+  float* quadrants = (float*) malloc(sizeof(float) * 3 * H*H);
+  fillMultiplierMap(quadrants, R);
+
+  rasterWeights = (float*) malloc(sizeof(float) * R * 3*R);
+  for (int y = 0; y < 3*R; y++) {
+    int band = y / R;
+    int qy = y % R >= H ? y % R - H : H - 1 - y % R;
+    for (int x = 0; x < R; x++) {
+      int qx = x >= H ? x - H : H - 1 - x;
+      rasterWeights[y * R + x] = quadrants[(band*H + qy) * H + qx];
+    }
+  }
+  free(quadrants);
+
+  int tiles = (R + RASTER_TILE - 1) / RASTER_TILE;
+
+  for (int i = 0; i < gatherWorkerCount; i++) {
+    RasterBuffers* b = &rasterBuffers[i];
+    // Four pixels are read at a time, so the last row needs some slack.
+    b->depth = (float*) malloc(sizeof(float) * (R * 3*R + 4));
+    b->polygons = (RasterPolygon*) malloc(sizeof(RasterPolygon) * ARRAY_LENGTH(rects));
+    b->bins = (int*) malloc(sizeof(int) * tiles * tiles * ARRAY_LENGTH(rects));
+    b->binCounts = (int*) malloc(sizeof(int) * tiles * tiles);
+  }
+}
+
+// Sets up the polygon through count screen space points, each with its
+// 1/w, u/w and v/w, unless it covers no pixel of the viewport.
+void addPolygon(RasterBuffers* b, int rect, const float (*points)[5], int count, int vx, int vy, int vw, int vh) {
+  RasterPolygon& p = b->polygons[b->polygonCount];
+
+  // The attribute planes come from the largest triangle of the fan, the
+  // one least thrown off by rounding.
+  float area = 0.0f;
+  int widest = 0;
+  float widestArea = 0.0f;
+  for (int k = 2; k < count; k++) {
+    float a = (points[k - 1][0] - points[0][0]) * (points[k][1] - points[0][1])
+      - (points[k][0] - points[0][0]) * (points[k - 1][1] - points[0][1]);
+    area += a;
+    if (fabsf(a) > fabsf(widestArea)) {
+      widest = k;
+      widestArea = a;
+    }
+  }
+  if (fabsf(area) < 1e-6f) {
+    return;
+  }
+
+  // Edges clipping left too short to have a direction are dropped; the
+  // others still bound the polygon.
+  float sign = area > 0.0f ? 1.0f : -1.0f;
+  p.edgeCount = 0;
+  for (int k = 0; k < count; k++) {
+    const float* s = points[k];
+    const float* t = points[(k + 1) % count];
+    float a = (s[1] - t[1]) * sign;
+    float bb = (t[0] - s[0]) * sign;
+    if (fabsf(a) + fabsf(bb) > 1e-6f) {
+      p.edges[p.edgeCount][0] = a;
+      p.edges[p.edgeCount][1] = bb;
+      p.edges[p.edgeCount][2] = (s[0] * t[1] - t[0] * s[1]) * sign;
+      p.edgeCount++;
+    }
+  }
+
+  // Over a triangle, each corner's attribute is weighted by the edge
+  // function of the edge opposite it, which is the doubled area there and
+  // zero at the other two corners.
+  const float* corners[3] = {points[0], points[widest - 1], points[widest]};
+  float opposite[3][3];
+  for (int k = 0; k < 3; k++) {
+    const float* s = corners[(k + 1) % 3];
+    const float* t = corners[(k + 2) % 3];
+    opposite[k][0] = s[1] - t[1];
+    opposite[k][1] = t[0] - s[0];
+    opposite[k][2] = s[0] * t[1] - t[0] * s[1];
+  }
+  for (int a = 0; a < 3; a++) {
+    for (int c = 0; c < 3; c++) {
+      p.planes[a][c] = (opposite[0][c] * corners[0][2 + a]
+                        + opposite[1][c] * corners[1][2 + a]
+                        + opposite[2][c] * corners[2][2 + a]) / widestArea;
+    }
+  }
+
+  float minX = points[0][0];
+  float maxX = points[0][0];
+  float minY = points[0][1];
+  float maxY = points[0][1];
+  for (int k = 1; k < count; k++) {
+    minX = glm::min(minX, points[k][0]);
+    maxX = glm::max(maxX, points[k][0]);
+    minY = glm::min(minY, points[k][1]);
+    maxY = glm::max(maxY, points[k][1]);
+  }
+
+  // Pixels whose centers can be inside.
+  p.x0 = glm::max(vx, (int) floorf(minX));
+  p.x1 = glm::min(vx + vw, (int) ceilf(maxX));
+  p.y0 = glm::max(vy, (int) floorf(minY));
+  p.y1 = glm::min(vy + vh, (int) ceilf(maxY));
+  if (p.x0 >= p.x1 || p.y0 >= p.y1) {
+    return;
+  }
+
+  p.rect = rect;
+  p.width = glm::length(rects[rect].da) * texelDensity;
+  p.height = glm::length(rects[rect].db) * texelDensity;
+  b->polygonCount++;
+}
+
+// Adds what the pixel at (x, y), at depth invW, sees of p.
+inline void shadePixel(const RasterPolygon& p, int x, int y, float invW, Color* sum) {
+  const int R = hemicubeResolution;
+  float px = x + 0.5f;
+  float py = y + 0.5f;
+  float w = 1.0f / invW;
+
+  float u = (p.planes[1][0] * px + p.planes[1][1] * py + p.planes[1][2]) * w;
+  float v = (p.planes[2][0] * px + p.planes[2][1] * py + p.planes[2][2]) * w;
+  int tx = glm::clamp((int) (u * p.width), 0, p.width - 1);
+  int ty = glm::clamp((int) (v * p.height), 0, p.height - 1);
+
+  *sum += sampledColor(textureData[p.rect][ty * p.width + tx]) * rasterWeights[y * R + x];
+}
+
+// The first pass keeps the largest 1/w, the nearest surface, at every
+// pixel. The second shades the pixels where a polygon has the kept depth,
+// and marks them done so a polygon sharing the edge doesn't shade them
+// again. Both work depth out the same way, so it compares exactly.
+void rasterizeTile(RasterBuffers* b, int tile, int tx0, int ty0, int tx1, int ty1, bool shade, Color* sum) {
+  const int R = hemicubeResolution;
+
+  for (int i = 0; i < b->binCounts[tile]; i++) {
+    const RasterPolygon& p = b->polygons[b->bins[tile * ARRAY_LENGTH(rects) + i]];
+    int x0 = glm::max(p.x0, tx0);
+    int x1 = glm::min(p.x1, tx1);
+    int y0 = glm::max(p.y0, ty0);
+    int y1 = glm::min(p.y1, ty1);
+
+    for (int y = y0; y < y1; y++) {
+      float py = y + 0.5f;
+      float* depth = b->depth + y * R;
+
+#if defined(__SSE__)
+      __m128 edgeX[MAX_CLIPPED_VERTICES];
+      __m128 edgeRow[MAX_CLIPPED_VERTICES];
+      for (int k = 0; k < p.edgeCount; k++) {
+        edgeX[k] = _mm_set1_ps(p.edges[k][0]);
+        edgeRow[k] = _mm_set1_ps(p.edges[k][1] * py + p.edges[k][2]);
+      }
+      __m128 depthX = _mm_set1_ps(p.planes[0][0]);
+      __m128 depthRow = _mm_set1_ps(p.planes[0][1] * py + p.planes[0][2]);
+      __m128 limit = _mm_set1_ps((float) x1);
+
+      for (int x = x0; x < x1; x += 4) {
+        __m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        __m128 inside = _mm_cmplt_ps(px, limit);
+        for (int k = 0; k < p.edgeCount; k++) {
+          __m128 e = _mm_add_ps(_mm_mul_ps(edgeX[k], px), edgeRow[k]);
+          inside = _mm_and_ps(inside, _mm_cmpge_ps(e, _mm_setzero_ps()));
+        }
+        if (!_mm_movemask_ps(inside)) {
+          continue;
+        }
+
+        __m128 z = _mm_add_ps(_mm_mul_ps(depthX, px), depthRow);
+        __m128 d = _mm_loadu_ps(depth + x);
+
+        if (!shade) {
+          __m128 nearest = _mm_max_ps(d, z);
+          _mm_storeu_ps(depth + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, d)));
+          continue;
+        }
+
+        int hits = _mm_movemask_ps(_mm_and_ps(inside, _mm_cmpeq_ps(z, d)));
+        if (hits) {
+          float invW[4];
+          _mm_storeu_ps(invW, z);
+          for (int l = 0; l < 4; l++) {
+            if (hits & (1 << l)) {
+              shadePixel(p, x + l, y, invW[l], sum);
+              depth[x + l] = -1.0f;
+            }
+          }
+        }
+      }
+#else
+      for (int x = x0; x < x1; x++) {
+        float px = x + 0.5f;
+        bool inside = true;
+        for (int k = 0; k < p.edgeCount && inside; k++) {
+          inside = p.edges[k][0] * px + (p.edges[k][1] * py + p.edges[k][2]) >= 0.0f;
+        }
+        if (!inside) {
+          continue;
+        }
+
+        float z = p.planes[0][0] * px + (p.planes[0][1] * py + p.planes[0][2]);
+        if (!shade) {
+          depth[x] = glm::max(depth[x], z);
+        } else if (z == depth[x]) {
+          shadePixel(p, x, y, z, sum);
+          depth[x] = -1.0f;
+        }
+      }
+#endif
+    }
+  }
+}
+
+// Clips, bins and rasterizes one face into the viewport (vx, vy, vw, vh)
+// of the worker's buffer.
+void rasterizeFace(RasterBuffers* b, const int* visible, int visibleCount, glm::mat4 transform,
+                   int vx, int vy, int vw, int vh, Color* sum) {
+  b->polygonCount = 0;
+
+  for (int i = 0; i < visibleCount; i++) {
+    Rect rect = rects[visible[i]];
+    ClipVertex polygon[MAX_CLIPPED_VERTICES] = {
+      {transform * glm::vec4(rect.origin, 1.0f), 0.0f, 0.0f},
+      {transform * glm::vec4(rect.origin + rect.da, 1.0f), 1.0f, 0.0f},
+      {transform * glm::vec4(rect.origin + rect.da + rect.db, 1.0f), 1.0f, 1.0f},
+      {transform * glm::vec4(rect.origin + rect.db, 1.0f), 0.0f, 1.0f}
+    };
+    int count = 4;
+
+    for (int p = 0; p < ARRAY_LENGTH(clipPlanes) && count; p++) {
+      int outside = 0;
+      for (int v = 0; v < count; v++) {
+        outside += glm::dot(clipPlanes[p], polygon[v].position) < 0.0f;
+      }
+      if (outside) {
+        ClipVertex clipped[MAX_CLIPPED_VERTICES];
+        count = outside == count ? 0 : clipPolygon(polygon, count, clipped, clipPlanes[p]);
+        memcpy(polygon, clipped, sizeof(ClipVertex) * count);
+      }
+    }
+    if (count < 3) {
+      continue;
+    }
+
+    float points[MAX_CLIPPED_VERTICES][5];
+    for (int v = 0; v < count; v++) {
+      glm::vec4 position = polygon[v].position;
+      float invW = 1.0f / position.w;
+      points[v][0] = vx + (position.x * invW * 0.5f + 0.5f) * vw;
+      points[v][1] = vy + (position.y * invW * 0.5f + 0.5f) * vh;
+      points[v][2] = invW;
+      points[v][3] = polygon[v].u * invW;
+      points[v][4] = polygon[v].v * invW;
+    }
+    addPolygon(b, visible[i], points, count, vx, vy, vw, vh);
+  }
+
+  int tilesX = (vw + RASTER_TILE - 1) / RASTER_TILE;
+  int tilesY = (vh + RASTER_TILE - 1) / RASTER_TILE;
+  memset(b->binCounts, 0, sizeof(int) * tilesX * tilesY);
+
+  for (int i = 0; i < b->polygonCount; i++) {
+    const RasterPolygon& p = b->polygons[i];
+    for (int ty = (p.y0 - vy) / RASTER_TILE; ty <= (p.y1 - 1 - vy) / RASTER_TILE; ty++) {
+      for (int tx = (p.x0 - vx) / RASTER_TILE; tx <= (p.x1 - 1 - vx) / RASTER_TILE; tx++) {
+        int tile = ty * tilesX + tx;
+        b->bins[tile * ARRAY_LENGTH(rects) + b->binCounts[tile]++] = i;
+      }
+    }
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int ty = 0; ty < tilesY; ty++) {
+      for (int tx = 0; tx < tilesX; tx++) {
+        int x0 = vx + tx * RASTER_TILE;
+        int y0 = vy + ty * RASTER_TILE;
+        rasterizeTile(b, ty * tilesX + tx, x0, y0,
+                      glm::min(x0 + RASTER_TILE, vx + vw), glm::min(y0 + RASTER_TILE, vy + vh),
+                      pass == 1, sum);
+      }
+    }
+  }
+}
+
+Color rasterHemicube(HemicubeSample sample, int worker) {
+  RasterBuffers* b = &rasterBuffers[worker];
+  const int R = hemicubeResolution;
+
+  Rect r = rects[sample.rect];
+  int width = glm::length(r.da) * texelDensity;
+  int height = glm::length(r.db) * texelDensity;
+  vec3 location = r.origin + r.da * ((sample.x + 0.5f) / width) + r.db * ((sample.y + 0.5f) / height);
+  vec3 n = normal(r);
+  vec3 up = upFor(n);
+  vec3 sideways = glm::cross(n, up);
+
+  // Back faces are culled, as on the GPU.
+  int visible[ARRAY_LENGTH(rects)];
+  int visibleCount = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    if (i != sample.rect && glm::dot(normal(rects[i]), location - rects[i].origin) > 0.0f) {
+      visible[visibleCount++] = i;
+    }
+  }
+
+  memset(b->depth, 0, sizeof(float) * R * 3*R);
+
+  const float f = HEMICUBE_NEAR;
+  Color sum = BLACK;
+
+  rasterizeFace(b, visible, visibleCount,
+                glm::frustum(-f, f, -f, f, f, HEMICUBE_FAR) * glm::lookAt(location, location + n, up),
+                FRONT_X(R), FRONT_Y(R), R, R, &sum);
+  rasterizeFace(b, visible, visibleCount,
+                glm::frustum(-f, 0.0f, -f, f, f, HEMICUBE_FAR) * glm::lookAt(location, location + sideways, up),
+                RIGHT_X(R), RIGHT_Y(R), R/2, R, &sum);
+  rasterizeFace(b, visible, visibleCount,
+                glm::frustum(0.0f, f, -f, f, f, HEMICUBE_FAR) * glm::lookAt(location, location - sideways, up),
+                LEFT_X(R), LEFT_Y(R), R/2, R, &sum);
+  rasterizeFace(b, visible, visibleCount,
+                glm::frustum(-f, f, 0.0f, f, f, HEMICUBE_FAR) * glm::lookAt(location, location - up, n),
+                TOP_X(R), TOP_Y(R), R, R/2, &sum);
+  rasterizeFace(b, visible, visibleCount,
+                glm::frustum(-f, f, -f, 0.0f, f, HEMICUBE_FAR) * glm::lookAt(location, location + up, -n),
+                BOTTOM_X(R), BOTTOM_Y(R), R, R/2, &sum);
+
+  return sum;
+}
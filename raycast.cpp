@@ -0,0 +1,285 @@
+// Gathering on the CPU: each texel casts raysPerTexel cosine weighted rays
+// from its center and averages the lightmap texels they hit, as the 8-bit
+// textures show them, which estimates the same integral the hemicube
+// renders. Rays are spread over the hemisphere by a Hammersley set, moved
+// per texel by a hashed offset so neighbouring texels' errors don't line up
+// into bands, and cast a packet at a time (see intersect.cpp).
+//
+// Both CPU gathers, this one and the rasterizer (see raster.cpp), share
+// texels out to a pool of threads as one contiguous range each. A thread
+// takes GATHER_CHUNK texels at a time from the front of its own range, and
+// once that is empty steals the back half of another thread's, so threads
+// that got the texels with clear views don't sit idle while others are
+// still busy.
+#define GATHER_CHUNK 16
+#define MAX_GATHER_THREADS 64
+
+struct GatherWorker {
+  SDL_Thread* thread;
+  SDL_SpinLock lock;
+  // The texels left to it, [next, end), as indices into gatherSamples.
+  int next;
+  int end;
+  int steals;
+};
+
+GatherWorker gatherWorkers[MAX_GATHER_THREADS];
+int gatherWorkerCount;
+
+SDL_sem* gatherJobReady;
+SDL_sem* gatherJobDone;
+
+// The texels being gathered, and what each gathered.
+HemicubeSample* gatherSamples;
+Color* gatherIrradiance;
+
+uint32_t hashTexel(int rect, int x, int y) {
+  uint32_t h = rect * 73856093u ^ y * 19349663u ^ x * 83492791u;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+float radicalInverse(uint32_t i) {
+  i = (i << 16) | (i >> 16);
+  i = ((i & 0x55555555u) << 1) | ((i & 0xaaaaaaaau) >> 1);
+  i = ((i & 0x33333333u) << 2) | ((i & 0xccccccccu) >> 2);
+  i = ((i & 0x0f0f0f0fu) << 4) | ((i & 0xf0f0f0f0u) >> 4);
+  i = ((i & 0x00ff00ffu) << 8) | ((i & 0xff00ff00u) >> 8);
+  return i * 2.3283064e-10f;
+}
+
+Color gatherTexel(HemicubeSample sample) {
+  Rect r = rects[sample.rect];
+  int width = glm::length(r.da) * texelDensity;
+  int height = glm::length(r.db) * texelDensity;
+  vec3 location = r.origin + r.da * ((sample.x + 0.5f) / width) + r.db * ((sample.y + 0.5f) / height);
+
+  vec3 n = normal(r);
+  vec3 tangent = glm::normalize(r.da);
+  vec3 bitangent = glm::cross(n, tangent);
+
+  uint32_t h = hashTexel(sample.rect, sample.x, sample.y);
+  float offsetS = (h & 0xffff) / 65536.0f;
+  float offsetT = (h >> 16) / 65536.0f;
+
+  // Rays go out RAY_LANES at a time, a packet's worth, all from the center.
+  RayPacket packet;
+  for (int lane = 0; lane < RAY_LANES; lane++) {
+    packet.ox[lane] = location.x;
+    packet.oy[lane] = location.y;
+    packet.oz[lane] = location.z;
+    packet.maxT[lane] = HEMICUBE_FAR;
+  }
+
+  Color sum = BLACK;
+  for (int first = 0; first < raysPerTexel; first += RAY_LANES) {
+    int count = glm::min(RAY_LANES, raysPerTexel - first);
+
+    for (int lane = 0; lane < count; lane++) {
+      int k = first + lane;
+      float s = (k + 0.5f) / raysPerTexel + offsetS;
+      float t = radicalInverse(k) + offsetT;
+      s -= floorf(s);
+      t -= floorf(t);
+
+      // Points spread evenly over the disk, lifted onto the hemisphere, are
+      // spread by the cosine.
+      float radius = sqrtf(s);
+      float angle = 2.0f * glm::pi<float>() * t;
+      vec3 direction = tangent * (radius * cosf(angle))
+        + bitangent * (radius * sinf(angle))
+        + n * sqrtf(1.0f - s);
+      packet.dx[lane] = direction.x;
+      packet.dy[lane] = direction.y;
+      packet.dz[lane] = direction.z;
+    }
+
+    castPacket(&packet, count, sample.rect, sample.rect);
+
+    for (int lane = 0; lane < count; lane++) {
+      int hit = packet.hit[lane];
+      if (hit < 0) {
+        continue;
+      }
+
+      int hitWidth = glm::length(rects[hit].da) * texelDensity;
+      int hitHeight = glm::length(rects[hit].db) * texelDensity;
+      int x = glm::min((int) (packet.u[lane] * hitWidth), hitWidth - 1);
+      int y = glm::min((int) (packet.v[lane] * hitHeight), hitHeight - 1);
+      sum += sampledColor(textureData[hit][y * hitWidth + x]);
+    }
+  }
+
+  return sum * (1.0f / raysPerTexel);
+}
+
+// Takes half of what another thread has left, or returns false once
+// there's nothing left anywhere.
+bool stealTexels(int index) {
+  GatherWorker* self = &gatherWorkers[index];
+
+  for (int k = 1; k < gatherWorkerCount; k++) {
+    GatherWorker* victim = &gatherWorkers[(index + k) % gatherWorkerCount];
+
+    SDL_AtomicLock(&victim->lock);
+    int end = victim->end;
+    int begin = end - (end - victim->next + 1) / 2;
+    if (begin < end) {
+      victim->end = begin;
+    }
+    SDL_AtomicUnlock(&victim->lock);
+
+    if (begin < end) {
+      SDL_AtomicLock(&self->lock);
+      self->next = begin;
+      self->end = end;
+      SDL_AtomicUnlock(&self->lock);
+      self->steals++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void runGatherWorker(int index) {
+  GatherWorker* self = &gatherWorkers[index];
+
+  for (;;) {
+    SDL_AtomicLock(&self->lock);
+    int begin = self->next;
+    int end = glm::min(begin + GATHER_CHUNK, self->end);
+    self->next = end;
+    SDL_AtomicUnlock(&self->lock);
+
+    if (begin >= end) {
+      if (!stealTexels(index)) {
+        return;
+      }
+      continue;
+    }
+
+    for (int i = begin; i < end; i++) {
+      gatherIrradiance[i] = gatherMode == GATHER_RASTER
+        ? rasterHemicube(gatherSamples[i], index)
+        : gatherTexel(gatherSamples[i]);
+    }
+  }
+}
+
+int SDLCALL gatherWorkerThread(void* data) {
+  int index = (int) (intptr_t) data;
+
+  for (;;) {
+    SDL_SemWait(gatherJobReady);
+    runGatherWorker(index);
+    SDL_SemPost(gatherJobDone);
+  }
+
+  return 0;
+}
+
+void cpuGatherSetup() {
+  if (!gatherThreads) {
+    gatherThreads = glm::clamp(SDL_GetCPUCount(), 1, MAX_GATHER_THREADS);
+  }
+  gatherWorkerCount = gatherThreads;
+
+  int texels = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+    texels += width * height;
+  }
+  gatherSamples = (HemicubeSample*) malloc(sizeof(HemicubeSample) * texels);
+  gatherIrradiance = (Color*) malloc(sizeof(Color) * texels);
+
+  // The main thread is worker 0.
+  gatherJobReady = SDL_CreateSemaphore(0);
+  gatherJobDone = SDL_CreateSemaphore(0);
+  for (int i = 1; i < gatherWorkerCount; i++) {
+    gatherWorkers[i].thread = SDL_CreateThread(gatherWorkerThread, "gather", (void*) (intptr_t) i);
+  }
+
+  printf("Gathering on %d threads\n", gatherWorkerCount);
+}
+
+// Gathers gatherSamples[0, count) into gatherIrradiance, and stores them.
+void runGatherJob(int count) {
+  for (int i = 0; i < gatherWorkerCount; i++) {
+    gatherWorkers[i].next = (long) count * i / gatherWorkerCount;
+    gatherWorkers[i].end = (long) count * (i + 1) / gatherWorkerCount;
+  }
+
+  for (int i = 1; i < gatherWorkerCount; i++) {
+    SDL_SemPost(gatherJobReady);
+  }
+  runGatherWorker(0);
+  for (int i = 1; i < gatherWorkerCount; i++) {
+    SDL_SemWait(gatherJobDone);
+  }
+
+  for (int i = 0; i < count; i++) {
+    storeSample(gatherSamples[i], gatherIrradiance[i]);
+  }
+}
+
+// Jacobi passes gather every texel at once from the lightmaps as the last
+// pass left them. Gauss-Seidel gathers a rect at a time, so later rects see
+// the ones already done.
+void cpuGatherPass() {
+  passError = 0.0f;
+  beginSettling();
+
+  for (int i = 0; i < gatherWorkerCount; i++) {
+    gatherWorkers[i].steals = 0;
+  }
+
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  int texels = 0;
+  int count = 0;
+  for (int i = 0; i < ARRAY_LENGTH(rects); i++) {
+    int width = glm::length(rects[i].da) * texelDensity;
+    int height = glm::length(rects[i].db) * texelDensity;
+
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        if (!texelSettled(i, y*width + x)) {
+          HemicubeSample sample = {i, x, y, 0};
+          gatherSamples[count++] = sample;
+        }
+      }
+    }
+    texels += width * height;
+
+    if (updateMode == UPDATE_GAUSS_SEIDEL) {
+      runGatherJob(count);
+      count = 0;
+    }
+  }
+  runGatherJob(count);
+
+  float seconds = (float) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+  int gathered = texels - passSkipped;
+  int steals = 0;
+  for (int i = 0; i < gatherWorkerCount; i++) {
+    steals += gatherWorkers[i].steals;
+  }
+
+  printf("Error: %f\n", passError);
+  if (gatherMode == GATHER_RASTER) {
+    printf("%d hemicubes in %.2fs, %.0f hemicubes/s on %d threads (%d steals)\n",
+           gathered, seconds, gathered / seconds, gatherWorkerCount, steals);
+  } else {
+    printf("%d texels, %ld rays in %.2fs, %.0f rays/s on %d threads (%d steals)\n",
+           gathered, (long) gathered * raysPerTexel, seconds, gathered * raysPerTexel / seconds,
+           gatherWorkerCount, steals);
+  }
+  reportSettling(texels);
+}
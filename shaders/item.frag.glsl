@@ -0,0 +1,24 @@
+#version 150
+
+out vec4 out_color;
+
+in vec2 ftexcoord;
+
+uniform sampler2D tex;
+uniform int rect;
+
+// Which lightmap texel is seen instead of its color: the rect plus one, so
+// the cleared background reads as nothing, and the texel nearest sampling
+// would pick. All are small enough to be exact in a half float. The back
+// of a rect has no lightmap, so when back faces are drawn they only hide
+// what is behind them.
+void main() {
+  if (!gl_FrontFacing) {
+    out_color = vec4(0.0);
+    return;
+  }
+
+  ivec2 size = textureSize(tex, 0);
+  ivec2 texel = clamp(ivec2(ftexcoord * vec2(size)), ivec2(0), size - 1);
+  out_color = vec4(rect + 1, texel, 1.0);
+}
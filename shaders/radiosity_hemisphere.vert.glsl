@@ -0,0 +1,27 @@
+#version 150
+
+in vec3 position;
+in vec2 texcoord;
+
+out vec2 ftexcoord;
+
+uniform mat4 camera;
+uniform float near;
+uniform float far;
+
+// Projects each point onto the unit hemisphere around the eye and that
+// straight down onto its base, so the image is the unit disk. Depth is the
+// distance to the eye, and w stays 1 so interpolation is linear on screen,
+// which the tessellated mesh keeps close enough.
+void main() {
+  vec3 p = (camera * vec4(position, 1.0)).xyz;
+  float distance = length(p);
+  vec3 direction = p / distance;
+
+  // Behind the surface, or so close to its plane that a triangle around
+  // the eye would be stretched across the whole disk.
+  gl_ClipDistance[0] = -p.z - near;
+
+  gl_Position = vec4(direction.xy, (distance - near) / (far - near) * 2.0 - 1.0, 1.0);
+  ftexcoord = texcoord;
+}
@@ -0,0 +1,42 @@
+#version 150
+
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 15) out;
+
+in vec3 gposition[];
+in vec2 gtexcoord[];
+
+out vec2 ftexcoord;
+
+// proj * camera for each hemicube face, in layer order.
+uniform mat4 faces[5];
+
+bool outside(vec4 a, vec4 b, vec4 c) {
+  return (a.x > a.w && b.x > b.w && c.x > c.w)
+    || (a.x < -a.w && b.x < -b.w && c.x < -c.w)
+    || (a.y > a.w && b.y > b.w && c.y > c.w)
+    || (a.y < -a.w && b.y < -b.w && c.y < -c.w)
+    || (a.z > a.w && b.z > b.w && c.z > c.w)
+    || (a.z < -a.w && b.z < -b.w && c.z < -c.w);
+}
+
+void main() {
+  for (int face = 0; face < 5; face++) {
+    vec4 clip[3];
+    for (int i = 0; i < 3; i++) {
+      clip[i] = faces[face] * vec4(gposition[i], 1.0);
+    }
+
+    if (outside(clip[0], clip[1], clip[2])) {
+      continue;
+    }
+
+    for (int i = 0; i < 3; i++) {
+      gl_Layer = face;
+      gl_Position = clip[i];
+      ftexcoord = gtexcoord[i];
+      EmitVertex();
+    }
+    EndPrimitive();
+  }
+}
@@ -0,0 +1,12 @@
+#version 150
+
+in vec3 position;
+in vec2 texcoord;
+
+out vec3 gposition;
+out vec2 gtexcoord;
+
+void main() {
+  gposition = position;
+  gtexcoord = texcoord;
+}
@@ -0,0 +1,47 @@
+#version 150
+
+#define BLOCK 4
+
+out vec4 out_color;
+
+uniform sampler2D source;
+uniform sampler2D multiplier;
+uniform bool weighted;
+uniform int resolution;
+
+// The source is an atlas of hemicubes; each target cell sums the matching
+// source cell, so the hemicubes of a batch are reduced side by side.
+uniform ivec2 source_cell;
+uniform ivec2 target_cell;
+
+// The multiplier texture holds one quadrant per R x R band of the hemicube,
+// so fold the pixel onto it.
+float weight(ivec2 p) {
+  int h = resolution / 2;
+  int band = p.y / resolution;
+  ivec2 q = ivec2(p.x, p.y - band * resolution);
+  q = max(q - h, h - 1 - q);
+  return texelFetch(multiplier, ivec2(q.x, band * h + q.y), 0).r;
+}
+
+void main() {
+  ivec2 target = ivec2(gl_FragCoord.xy);
+  ivec2 cell = target / target_cell;
+  ivec2 local = (target - cell * target_cell) * BLOCK;
+  vec3 sum = vec3(0.0);
+
+  for (int y = 0; y < BLOCK; y++) {
+    for (int x = 0; x < BLOCK; x++) {
+      ivec2 p = local + ivec2(x, y);
+      if (p.x < source_cell.x && p.y < source_cell.y) {
+        vec3 c = texelFetch(source, cell * source_cell + p, 0).rgb;
+        if (weighted) {
+          c *= weight(p);
+        }
+        sum += c;
+      }
+    }
+  }
+
+  out_color = vec4(sum, 1.0);
+}